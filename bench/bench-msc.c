@@ -0,0 +1,853 @@
+/*
+ * bench-msc.c -- Microbenchmark of msc_scsi_read/msc_scsi_write
+ *
+ * Copyright (C) 2026 Free Software Initiative of Japan
+ *
+ * This file is a part of Fraucheky, making sure to have GNU GPL on a
+ * USB thumb drive
+ *
+ * Fraucheky is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Fraucheky is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The backend is measured by classes of sectors, and by access
+ * patterns.  Classes are found from the volume itself (boot sector
+ * and root directory), so that any layout generated by configure
+ * can be measured.
+ *
+ * Output is a line for each measurement:
+ *
+ *   <op> <kind> <name> <count> <cost per op> <unit>
+ *
+ * On GNU/Linux, the unit is nanoseconds of CLOCK_MONOTONIC.  With
+ * BENCH_DWT, the unit is cycles of DWT cycle counter of Cortex-M,
+ * and the application supplies bench_output to print the lines.
+ *
+ * On GNU/Linux, streaming read of the slow backend is also measured,
+ * with and without asynchronous requests.  With FRAUCHEKY_FTL,
+ * flash-ftl.c is measured on flash ROM emulated in RAM.  With
+ * FRAUCHEKY_CRYPT, read of disk-crypt.c is compared with plaintext.
+ * With BENCH_CRYPT_KEY, the volume encrypted by configure is read
+ * back by disk-crypt.c, and checked.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msc.h"
+#include "disk-on-rom.h"
+
+extern int msc_scsi_write (uint32_t lba, const uint8_t *buf, size_t size);
+extern int msc_scsi_read (uint32_t lba, const uint8_t **sector_p);
+extern uint32_t msc_scsi_capacity (void);
+extern int msc_scsi_verify (uint32_t lba);
+extern uint32_t msc_self_test (uint32_t lba, uint32_t count,
+			       uint32_t *lba_p);
+#ifndef BENCH_DWT
+#include <chopstx.h>
+
+extern int fraucheky_file_open (const char *filename, int writable);
+extern const struct msc_medium *fraucheky_slow_medium (uint32_t usec,
+						       int async);
+#ifdef FRAUCHEKY_FTL
+#ifndef FRAUCHEKY_FTL_PAGE_SIZE
+#define FRAUCHEKY_FTL_PAGE_SIZE 1024
+#endif
+#ifndef FRAUCHEKY_FTL_LBAS_MAX
+#define FRAUCHEKY_FTL_LBAS_MAX 256
+#endif
+extern int fraucheky_ftl_init (uintptr_t addr, unsigned int pages);
+extern int msc_scsi_discard (uint32_t lba, uint32_t count);
+extern int msc_rom_read (uint32_t lba, const uint8_t **sector_p);
+extern void fraucheky_ftl_wear (uint32_t *min_p, uint32_t *max_p);
+#endif
+#ifdef FRAUCHEKY_CRYPT
+extern const struct msc_medium *fraucheky_crypt_medium
+	(const struct msc_medium *m, const uint8_t *key);
+#endif
+#endif
+
+int fraucheky_main_active;
+
+int
+fraucheky_enabled (void)
+{
+  return 0;
+}
+
+#ifdef BENCH_DWT
+#define DEMCR      (*(volatile uint32_t *)0xE000EDFC)
+#define DWT_CTRL   (*(volatile uint32_t *)0xE0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+
+#define BENCH_UNIT "cycles"
+
+extern void bench_output (const char *line);
+
+static void
+bench_clock_init (void)
+{
+  DEMCR |= (1 << 24);		/* TRCENA */
+  DWT_CYCCNT = 0;
+  DWT_CTRL |= 1;		/* CYCCNTENA */
+}
+
+static uint64_t
+bench_clock (void)
+{
+  return DWT_CYCCNT;
+}
+#else
+#include <time.h>
+
+#define BENCH_UNIT "ns"
+
+static void
+bench_output (const char *line)
+{
+  fputs (line, stdout);
+}
+
+static void
+bench_clock_init (void)
+{
+}
+
+static uint64_t
+bench_clock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#ifndef BENCH_BACKEND
+#define BENCH_BACKEND "rom"
+#endif
+
+#ifndef BENCH_ITERATIONS
+#define BENCH_ITERATIONS 100000
+#endif
+
+#define CLASS_MAX 1024
+
+enum {
+  CLASS_METADATA, CLASS_DATA, CLASS_TAIL, CLASS_OUT_OF_RANGE, CLASS_NUM
+};
+
+static const char *class_name[CLASS_NUM] = {
+  "metadata", "data", "tail", "out-of-range"
+};
+
+static uint32_t class_lba[CLASS_NUM][CLASS_MAX];
+static int class_count[CLASS_NUM];
+
+static uint32_t mount_lba[CLASS_MAX];
+static int mount_count;
+
+/* Start of each file in the root directory, in order.  */
+static uint32_t file_lba[CLASS_MAX];
+static int file_count;
+static uint32_t sectors_per_cluster;
+
+/* Start cluster of each entry in the root directory, in order.  */
+static uint16_t root_cluster[CLASS_MAX];
+static int root_count;
+static uint32_t drophere_lba;
+
+static const char *backend = BENCH_BACKEND;
+static uint32_t total_sectors;
+static volatile uint32_t sink;
+
+static void
+add_lba (uint32_t *list, int *count_p, uint32_t lba)
+{
+  if (*count_p < CLASS_MAX)
+    list[(*count_p)++] = lba;
+}
+
+static uint16_t
+get16 (const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get32 (const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Classify sectors by the boot sector and the root directory.  */
+static int
+classify (void)
+{
+  const uint8_t *p;
+  uint32_t part_start = 0, fat0, rootdir, data, lba;
+  uint32_t spc, entries, i;
+  uint8_t is_data[CLASS_MAX * 4];
+
+  total_sectors = msc_scsi_capacity ();
+  memset (is_data, 0, sizeof is_data);
+
+  if (msc_scsi_read (0, &p))
+    return -1;
+  if (p[0] != 0xeb)		/* Partition table.  */
+    {
+      part_start = get32 (p + 446 + 8);
+      add_lba (mount_lba, &mount_count, 0);
+      add_lba (class_lba[CLASS_METADATA], &class_count[CLASS_METADATA], 0);
+      if (msc_scsi_read (part_start, &p))
+	return -1;
+    }
+
+  spc = sectors_per_cluster = p[13];
+  fat0 = part_start + get16 (p + 14);
+  entries = get16 (p + 17);
+  rootdir = fat0 + p[16] * get16 (p + 22);
+  data = rootdir + (entries * 32 + MSC_SECTOR_SIZE - 1) / MSC_SECTOR_SIZE;
+
+  add_lba (mount_lba, &mount_count, part_start);
+  add_lba (mount_lba, &mount_count, fat0);
+  add_lba (mount_lba, &mount_count, fat0 + 1);
+  add_lba (mount_lba, &mount_count, rootdir);
+  for (lba = part_start; lba < data; lba++)
+    add_lba (class_lba[CLASS_METADATA], &class_count[CLASS_METADATA], lba);
+
+  if (msc_scsi_read (rootdir, &p))
+    return -1;
+
+  for (i = 0; i < entries && p[i * 32] != 0; i++)
+    {
+      const uint8_t *e = p + i * 32;
+      uint32_t start = data + (get16 (e + 26) - 2) * spc;
+      uint32_t size = get32 (e + 28);
+      uint32_t n = (size + MSC_SECTOR_SIZE - 1) / MSC_SECTOR_SIZE;
+
+      if ((e[11] & 0x08))	/* Volume label.  */
+	continue;
+
+      add_lba (mount_lba, &mount_count, start);
+      if (root_count < CLASS_MAX)
+	root_cluster[root_count++] = get16 (e + 26);
+      if ((e[11] & 0x10))	/* Directory.  */
+	{
+	  drophere_lba = start;
+	  add_lba (class_lba[CLASS_METADATA], &class_count[CLASS_METADATA],
+		   start);
+	  if (start < sizeof is_data)
+	    is_data[start] = 1;
+	  continue;
+	}
+
+      add_lba (file_lba, &file_count, start);
+      for (lba = start; lba < start + n; lba++)
+	{
+	  if (lba + 1 == start + n && (size % MSC_SECTOR_SIZE) != 0)
+	    add_lba (class_lba[CLASS_TAIL], &class_count[CLASS_TAIL], lba);
+	  else
+	    add_lba (class_lba[CLASS_DATA], &class_count[CLASS_DATA], lba);
+	  if (lba < sizeof is_data)
+	    is_data[lba] = 1;
+	}
+    }
+
+  /* Unused sectors are counted as data.  For a large volume, only
+     the first ones.  */
+  for (lba = data; lba < total_sectors && lba < sizeof is_data; lba++)
+    if (!is_data[lba])
+      add_lba (class_lba[CLASS_DATA], &class_count[CLASS_DATA], lba);
+
+  for (i = 0; i < 16; i++)
+    add_lba (class_lba[CLASS_OUT_OF_RANGE], &class_count[CLASS_OUT_OF_RANGE],
+	     total_sectors + i * 64);
+
+  return 0;
+}
+
+/*
+ * Start clusters in the root directory (and "." of DROPHERE) should
+ * be the layout by configure: DROPHERE at #2, then the files.
+ */
+static uint32_t
+check_layout (void)
+{
+  static const uint16_t expected[] = {
+    2 + 1,
+    2 + 1 + COPYING_CLUSTERS,
+    2 + 1 + COPYING_CLUSTERS + README_CLUSTERS,
+    2
+  };
+  const int n = sizeof expected / sizeof expected[0];
+  const uint8_t *p;
+  uint32_t bad = 0;
+  int i;
+
+  if (root_count != n)
+    bad++;
+  for (i = 0; i < root_count && i < n; i++)
+    if (root_cluster[i] != expected[i])
+      bad++;
+
+  if (msc_scsi_read (drophere_lba, &p) || get16 (p + 26) != 2)
+    bad++;
+
+  return bad;
+}
+
+static void
+report (const char *op, const char *kind, const char *name,
+	uint32_t count, uint64_t elapsed)
+{
+  char line[128];
+  uint64_t cost100 = count ? elapsed * 100 / count : 0;
+
+  snprintf (line, sizeof line, "%-5s %-7s %-12s %8u %8u.%02u %s\n",
+	    op, kind, name, (unsigned int)count,
+	    (unsigned int)(cost100 / 100), (unsigned int)(cost100 % 100),
+	    BENCH_UNIT);
+  bench_output (line);
+}
+
+static uint64_t
+run_read (const uint32_t *list, int n, uint32_t iterations)
+{
+  uint64_t start;
+  uint32_t i;
+  const uint8_t *p;
+
+  start = bench_clock ();
+  for (i = 0; i < iterations; i++)
+    if (msc_scsi_read (list[i % n], &p) == 0)
+      sink += p[MSC_SECTOR_SIZE - 1];
+  return bench_clock () - start;
+}
+
+static uint32_t
+random_lba (uint32_t *state)
+{
+  *state = *state * 1103515245 + 12345;
+  return (*state >> 8) % total_sectors;
+}
+
+#ifndef BENCH_DWT
+/*
+ * Streaming read of the slow backend (disk-slow.c), by the model of
+ * READ(10) of usb-msc.c, where sending a sector to the host takes
+ * BENCH_USB_USEC.  It compares synchronous read with asynchronous
+ * requests of the window from 1 to MSC_ASYNC_WINDOW.
+ */
+#ifndef BENCH_SLOW_USEC
+#define BENCH_SLOW_USEC 500
+#endif
+
+#ifndef BENCH_USB_USEC
+#define BENCH_USB_USEC 500	/* 512-byte at full-speed, roughly.  */
+#endif
+
+#define BENCH_STREAM_SECTORS 256
+
+static chopstx_mutex_t stream_mutex;
+static chopstx_cond_t stream_cond;
+
+static void
+stream_complete (struct msc_request *req)
+{
+  chopstx_mutex_lock (&stream_mutex);
+  req->done = 1;
+  chopstx_cond_signal (&stream_cond);
+  chopstx_mutex_unlock (&stream_mutex);
+}
+
+static void
+stream_submit (const struct msc_medium *m, struct msc_request *req,
+	       uint32_t lba)
+{
+  req->lba = lba % total_sectors;
+  req->sector = NULL;
+  req->status = 0;
+  req->complete = stream_complete;
+  req->done = 0;
+  if ((*m->submit) (req))
+    req->done = 1;
+}
+
+static uint64_t
+run_stream (const struct msc_medium *m, uint32_t window, uint32_t count)
+{
+  struct msc_request req[MSC_ASYNC_WINDOW];
+  struct msc_request *r;
+  uint32_t submitted, sent;
+  const uint8_t *p;
+  uint64_t start;
+
+  start = bench_clock ();
+  if (m->submit == NULL)
+    for (sent = 0; sent < count; sent++)
+      {
+	if ((*m->read) (sent % total_sectors, &p) == 0)
+	  sink += p[0];
+	chopstx_usec_wait (BENCH_USB_USEC);
+      }
+  else
+    {
+      for (submitted = 0; submitted < count && submitted < window;
+	   submitted++)
+	stream_submit (m, &req[submitted], submitted);
+
+      for (sent = 0; sent < count; sent++)
+	{
+	  r = &req[sent % window];
+	  chopstx_mutex_lock (&stream_mutex);
+	  while (!r->done)
+	    chopstx_cond_wait (&stream_cond, &stream_mutex);
+	  chopstx_mutex_unlock (&stream_mutex);
+
+	  if (r->status == 0)
+	    sink += r->sector[0];
+	  chopstx_usec_wait (BENCH_USB_USEC);
+	  if (submitted < count)
+	    stream_submit (m, r, submitted++);
+	}
+    }
+
+  return bench_clock () - start;
+}
+
+static void
+bench_stream (void)
+{
+  char line[128], name[16];
+  uint32_t window;
+
+  chopstx_mutex_init (&stream_mutex);
+  chopstx_cond_init (&stream_cond);
+
+  snprintf (line, sizeof line, "# stream slow_usec %u usb_usec %u\n",
+	    (unsigned int)BENCH_SLOW_USEC, (unsigned int)BENCH_USB_USEC);
+  bench_output (line);
+
+  report ("read", "stream", "sync", BENCH_STREAM_SECTORS,
+	  run_stream (fraucheky_slow_medium (BENCH_SLOW_USEC, 0), 1,
+		      BENCH_STREAM_SECTORS));
+
+  for (window = 1; window <= MSC_ASYNC_WINDOW; window *= 2)
+    {
+      snprintf (name, sizeof name, "async-%u", (unsigned int)window);
+      report ("read", "stream", name, BENCH_STREAM_SECTORS,
+	      run_stream (fraucheky_slow_medium (BENCH_SLOW_USEC, 1), window,
+			  BENCH_STREAM_SECTORS));
+    }
+}
+#endif
+
+#if defined(FRAUCHEKY_CRYPT) && !defined(BENCH_DWT)
+/*
+ * Read of encrypted sectors (disk-crypt.c), compared with plaintext.
+ * Sectors are read back to back (the keystream is computed in the
+ * read), and by the model of READ(10) with BENCH_USB_USEC for each
+ * sector, where the keystream of the next sector is computed while
+ * a sector is sent.  For the latter, the time in the read is
+ * reported, too.
+ */
+static struct msc_medium crypt_plain;
+
+static uint64_t
+run_crypt (const struct msc_medium *m, uint32_t usb_usec, uint32_t count,
+	   uint64_t *read_p)
+{
+  uint64_t start, t;
+  uint32_t i;
+  const uint8_t *p;
+
+  *read_p = 0;
+  start = bench_clock ();
+  for (i = 0; i < count; i++)
+    {
+      t = bench_clock ();
+      if ((*m->read) (i % total_sectors, &p) == 0)
+	sink += p[0];
+      *read_p += bench_clock () - t;
+      if (usb_usec)
+	chopstx_usec_wait (usb_usec);
+    }
+
+  return bench_clock () - start;
+}
+
+static void
+bench_crypt (uint32_t iterations)
+{
+  static const uint8_t key[32] = { 0x46, 0x72, 0x61, 0x75, 0x63, 0x68 };
+  const struct msc_medium *crypt;
+  uint64_t read;
+
+  crypt_plain.nblocks = total_sectors;
+  crypt_plain.read = msc_scsi_read;
+  crypt = fraucheky_crypt_medium (&crypt_plain, key);
+
+  report ("read", "crypt", "plain", iterations,
+	  run_crypt (&crypt_plain, 0, iterations, &read));
+  report ("read", "crypt", "inline", iterations,
+	  run_crypt (crypt, 0, iterations, &read));
+
+  report ("read", "crypt", "stream-plain", BENCH_STREAM_SECTORS,
+	  run_crypt (&crypt_plain, BENCH_USB_USEC, BENCH_STREAM_SECTORS,
+		     &read));
+  report ("read", "crypt", "in-read-plain", BENCH_STREAM_SECTORS, read);
+  report ("read", "crypt", "stream-crypt", BENCH_STREAM_SECTORS,
+	  run_crypt (crypt, BENCH_USB_USEC, BENCH_STREAM_SECTORS, &read));
+  report ("read", "crypt", "in-read-crypt", BENCH_STREAM_SECTORS, read);
+}
+
+#ifdef BENCH_CRYPT_KEY
+/*
+ * Round trip of the volume encrypted by configure.  The plaintext is
+ * the volume before fraucheky_crypt_medium (NULL, key), where sectors
+ * generated by disk-on-rom.c are not yet encrypted, with the files
+ * linked in plaintext.  All sectors read by the medium should be the
+ * plaintext, and no sector of files should be on ROM in plaintext.
+ */
+extern const uint8_t _binary_COPYING_start[], _binary_COPYING_end[];
+extern const uint8_t _binary_README_start[], _binary_README_end[];
+extern const uint8_t _binary_INDEX_start[], _binary_INDEX_end[];
+
+static void
+check_crypt (void)
+{
+  static const uint8_t *const files[][2] = {
+    { _binary_COPYING_start, _binary_COPYING_end },
+    { _binary_README_start, _binary_README_end },
+    { _binary_INDEX_start, _binary_INDEX_end },
+  };
+  const char *hex = BENCH_CRYPT_KEY;
+  const struct msc_medium *crypt;
+  const uint8_t *p;
+  uint8_t key[32], *plain, *q;
+  uint32_t lba, size, off, n, bad = 0, clear = 0;
+  char line[128];
+  int i;
+
+  for (i = 0; i < 32; i++)
+    {
+      char byte[3] = { hex[i * 2], hex[i * 2 + 1], 0 };
+
+      key[i] = strtoul (byte, NULL, 16);
+    }
+
+  plain = malloc (total_sectors * MSC_SECTOR_SIZE);
+  if (plain == NULL)
+    return;
+
+  for (lba = 0; lba < total_sectors; lba++)
+    {
+      if (msc_scsi_read (lba, &p))
+	bad++;
+      else
+	memcpy (plain + lba * MSC_SECTOR_SIZE, p, MSC_SECTOR_SIZE);
+    }
+
+  if (file_count != 3)
+    bad++;
+  for (i = 0; i < file_count && i < 3; i++)
+    {
+      q = plain + file_lba[i] * MSC_SECTOR_SIZE;
+      size = files[i][1] - files[i][0];
+      for (off = 0; off < size; off += MSC_SECTOR_SIZE)
+	{
+	  n = size - off < MSC_SECTOR_SIZE ? size - off : MSC_SECTOR_SIZE;
+	  if (!memcmp (q + off, files[i][0] + off, n))
+	    clear++;
+	}
+      /* Padded by zero to the cluster.  */
+      n = sectors_per_cluster * MSC_SECTOR_SIZE;
+      memcpy (q, files[i][0], size);
+      memset (q + size, 0, (n - size % n) % n);
+    }
+
+  crypt = fraucheky_crypt_medium (NULL, key);
+  for (lba = 0; lba < total_sectors; lba++)
+    if ((*crypt->read) (lba, &p)
+	|| memcmp (p, plain + lba * MSC_SECTOR_SIZE, MSC_SECTOR_SIZE))
+      bad++;
+
+  snprintf (line, sizeof line, "# crypt sectors %u bad %u clear %u\n",
+	    (unsigned int)total_sectors, (unsigned int)bad,
+	    (unsigned int)clear);
+  bench_output (line);
+  free (plain);
+}
+#endif
+#endif
+
+#if defined(FRAUCHEKY_FTL) && !defined(BENCH_DWT)
+/*
+ * Flash ROM emulated in RAM, for flash-ftl.c.  Like NOR flash,
+ * programming can only clear bits, and erase sets all bits.
+ */
+#ifndef BENCH_FTL_PAGES
+#define BENCH_FTL_PAGES 16
+#endif
+
+#define BENCH_FTL_SIZE (BENCH_FTL_PAGES * FRAUCHEKY_FTL_PAGE_SIZE)
+
+static uint8_t ftl_flash[BENCH_FTL_SIZE] __attribute__ ((aligned (4)));
+static uint8_t ftl_shadow[FRAUCHEKY_FTL_LBAS_MAX][MSC_SECTOR_SIZE];
+
+void
+flash_unlock (void)
+{
+}
+
+int
+flash_program_halfword (uintptr_t addr, uint16_t data)
+{
+  *(uint16_t *)addr &= data;
+  return 0;
+}
+
+int
+flash_erase_page (uintptr_t addr)
+{
+  memset ((void *)addr, 0xff, FRAUCHEKY_FTL_PAGE_SIZE);
+  return 0;
+}
+
+int
+flash_check_blank (const uint8_t *p_start, size_t size)
+{
+  const uint8_t *p;
+
+  for (p = p_start; p < p_start + size; p++)
+    if (*p != 0xff)
+      return 0;
+
+  return 1;
+}
+
+int
+flash_write (uintptr_t dst_addr, const uint8_t *src, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i += 2)
+    flash_program_halfword (dst_addr + i, src[i] | (src[i + 1] << 8));
+
+  return 1;
+}
+
+/*
+ * Random rewrites of writable sectors, checked by the shadow copy in
+ * RAM, then, mount again and check all sectors.
+ */
+static void
+bench_ftl (uint32_t iterations)
+{
+  static uint8_t data[MSC_SECTOR_SIZE];
+  const uint8_t *p;
+  uint32_t i, lba, n, state = 1, bad = 0, erase_min, erase_max;
+  uint64_t start;
+  char line[128];
+  int r;
+
+  memset (ftl_flash, 0xff, sizeof ftl_flash);
+  start = bench_clock ();
+  r = fraucheky_ftl_init ((uintptr_t)ftl_flash, BENCH_FTL_PAGES);
+  report ("mount", "ftl", "blank", 1, bench_clock () - start);
+  if (r <= 0)
+    return;
+
+  n = r;
+  for (lba = 0; lba < n; lba++)
+    {
+      msc_scsi_read (lba, &p);
+      memcpy (ftl_shadow[lba], p, MSC_SECTOR_SIZE);
+    }
+
+  start = bench_clock ();
+  for (i = 0; i < iterations; i++)
+    {
+      state = state * 1103515245 + 12345;
+      lba = (state >> 8) % n;
+      /* Hot sectors at the start, like FAT and directory.  */
+      if (state & 0x80000000)
+	lba %= 4;
+      memset (data, i, sizeof data);
+      memcpy (data, &lba, sizeof lba);
+      if (msc_scsi_write (lba, data, MSC_SECTOR_SIZE))
+	break;
+      memcpy (ftl_shadow[lba], data, MSC_SECTOR_SIZE);
+    }
+  report ("write", "ftl", "random", i, bench_clock () - start);
+
+  start = bench_clock ();
+  for (i = 0; i < iterations; i++)
+    {
+      lba = i % n;
+      if (msc_scsi_read (lba, &p)
+	  || memcmp (p, ftl_shadow[lba], MSC_SECTOR_SIZE))
+	bad++;
+    }
+  report ("read", "ftl", "random", iterations, bench_clock () - start);
+
+  start = bench_clock ();
+  r = fraucheky_ftl_init ((uintptr_t)ftl_flash, BENCH_FTL_PAGES);
+  report ("mount", "ftl", "remount", 1, bench_clock () - start);
+  for (lba = 0; lba < n; lba++)
+    if (r != (int)n || msc_scsi_read (lba, &p)
+	|| memcmp (p, ftl_shadow[lba], MSC_SECTOR_SIZE))
+      bad++;
+
+  /* Discarded sectors read as the volume on ROM.  */
+  if (msc_scsi_discard (n / 2, n - n / 2))
+    bad++;
+  for (lba = n / 2; lba < n; lba++)
+    {
+      if (msc_scsi_read (lba, &p))
+	bad++;
+      memcpy (data, p, MSC_SECTOR_SIZE);
+      if (msc_rom_read (lba, &p) || memcmp (p, data, MSC_SECTOR_SIZE))
+	bad++;
+    }
+
+  fraucheky_ftl_wear (&erase_min, &erase_max);
+  snprintf (line, sizeof line,
+	    "# ftl sectors %u pages %u erase min %u max %u bad %u\n",
+	    (unsigned int)n, (unsigned int)BENCH_FTL_PAGES,
+	    (unsigned int)erase_min, (unsigned int)erase_max,
+	    (unsigned int)bad);
+  bench_output (line);
+}
+#endif
+
+int
+bench_main (uint32_t iterations)
+{
+  static uint8_t data[MSC_SECTOR_SIZE];
+  uint32_t list[CLASS_MAX];
+  uint32_t i, state = 1;
+  uint64_t start;
+  char line[128];
+  int c;
+
+  bench_clock_init ();
+  if (classify () < 0)
+    return -1;
+
+  snprintf (line, sizeof line, "# fraucheky-bench 1 backend %s\n", backend);
+  bench_output (line);
+  snprintf (line, sizeof line,
+	    "# sector_size %u total_sectors %u iterations %u\n",
+	    (unsigned int)MSC_SECTOR_SIZE, (unsigned int)total_sectors,
+	    (unsigned int)iterations);
+  bench_output (line);
+
+  if (!strcmp (backend, BENCH_BACKEND))
+    {
+      snprintf (line, sizeof line, "# layout clusters %d bad %u\n",
+		root_count, (unsigned int)check_layout ());
+      bench_output (line);
+    }
+
+  for (c = 0; c < CLASS_NUM; c++)
+    if (class_count[c])
+      report ("read", "class", class_name[c], iterations,
+	      run_read (class_lba[c], class_count[c], iterations));
+
+  for (i = 0; i < CLASS_MAX && i < total_sectors; i++)
+    list[i] = i;
+  report ("read", "pattern", "sequential", iterations,
+	  run_read (list, i, iterations));
+
+  for (i = 0; i < CLASS_MAX; i++)
+    list[i] = random_lba (&state);
+  report ("read", "pattern", "random", iterations,
+	  run_read (list, CLASS_MAX, iterations));
+
+  report ("read", "pattern", "mount", iterations,
+	  run_read (mount_lba, mount_count, iterations));
+
+  start = bench_clock ();
+  for (i = 0; i < iterations; i++)
+    if (msc_scsi_verify (class_lba[CLASS_DATA][i % class_count[CLASS_DATA]]))
+      break;
+  report ("verify", "class", "data", i, bench_clock () - start);
+
+  start = bench_clock ();
+  i = msc_self_test (0, total_sectors, &state);
+  report ("verify", "pattern", "self-test", total_sectors,
+	  bench_clock () - start);
+  snprintf (line, sizeof line, "# self_test bad %u first %u\n",
+	    (unsigned int)i, (unsigned int)state);
+  bench_output (line);
+
+  memset (data, 0xe5, sizeof data);
+  start = bench_clock ();
+  for (i = 0; i < iterations; i++)
+    msc_scsi_write (class_lba[CLASS_DATA][i % class_count[CLASS_DATA]],
+		    data, MSC_SECTOR_SIZE);
+  report ("write", "class", "data", iterations, bench_clock () - start);
+
+#ifndef BENCH_DWT
+  bench_stream ();
+#ifdef FRAUCHEKY_CRYPT
+  bench_crypt (iterations);
+#ifdef BENCH_CRYPT_KEY
+  check_crypt ();
+#endif
+#endif
+#ifdef FRAUCHEKY_FTL
+  /* It replaces the volume, so, it's the last.  */
+  if (strcmp (backend, "file"))
+    bench_ftl (iterations);
+#endif
+#endif
+  return 0;
+}
+
+#ifndef BENCH_DWT
+int
+main (int argc, char *argv[])
+{
+  uint32_t iterations = BENCH_ITERATIONS;
+
+  if (argc > 1)
+    iterations = strtoul (argv[1], NULL, 0);
+
+  /* bench-msc ITERATIONS IMAGE [rw] */
+  if (argc > 2)
+    {
+      if (fraucheky_file_open (argv[2], argc > 3 && !strcmp (argv[3], "rw"))
+	  < 0)
+	{
+	  fprintf (stderr, "bench-msc: can't open %s\n", argv[2]);
+	  exit (1);
+	}
+      backend = "file";
+    }
+
+  if (bench_main (iterations) < 0)
+    {
+      fputs ("bench-msc: can't classify sectors\n", stderr);
+      exit (1);
+    }
+
+  return 0;
+}
+#endif
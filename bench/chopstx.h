@@ -0,0 +1,106 @@
+/*
+ * chopstx.h -- Subset of Chopstx API by POSIX threads, for benchmark
+ *
+ * Copyright (C) 2026 Free Software Initiative of Japan
+ *
+ * This file is a part of Fraucheky, making sure to have GNU GPL on a
+ * USB thumb drive
+ *
+ * Fraucheky is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Fraucheky is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The benchmark runs backends as a plain process, without the
+ * scheduler of Chopstx.  This header takes precedence over the one of
+ * Chopstx, and provides what backends use.  Priority and the stack
+ * given to chopstx_create are ignored.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+typedef pthread_t chopstx_t;
+typedef uint8_t chopstx_prio_t;
+typedef pthread_mutex_t chopstx_mutex_t;
+typedef pthread_cond_t chopstx_cond_t;
+typedef void *(voidfunc) (void *);
+
+static inline void
+chopstx_mutex_init (chopstx_mutex_t *mutex)
+{
+  pthread_mutex_init (mutex, NULL);
+}
+
+static inline void
+chopstx_mutex_lock (chopstx_mutex_t *mutex)
+{
+  pthread_mutex_lock (mutex);
+}
+
+static inline void
+chopstx_mutex_unlock (chopstx_mutex_t *mutex)
+{
+  pthread_mutex_unlock (mutex);
+}
+
+static inline void
+chopstx_cond_init (chopstx_cond_t *cond)
+{
+  pthread_cond_init (cond, NULL);
+}
+
+static inline void
+chopstx_cond_wait (chopstx_cond_t *cond, chopstx_mutex_t *mutex)
+{
+  pthread_cond_wait (cond, mutex);
+}
+
+static inline void
+chopstx_cond_signal (chopstx_cond_t *cond)
+{
+  pthread_cond_signal (cond);
+}
+
+static inline chopstx_t
+chopstx_create (uint32_t flags_and_prio, uintptr_t stack_addr,
+		size_t stack_size, voidfunc thread_entry, void *arg)
+{
+  pthread_t thd;
+
+  (void)flags_and_prio;
+  (void)stack_addr;
+  (void)stack_size;
+  pthread_create (&thd, NULL, thread_entry, arg);
+  return thd;
+}
+
+static inline void
+chopstx_usec_wait (uint32_t usec)
+{
+  struct timespec ts;
+
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  while (nanosleep (&ts, &ts) != 0)
+    ;
+}
+
+static inline chopstx_prio_t
+chopstx_setpriority (chopstx_prio_t prio)
+{
+  return prio;
+}
@@ -0,0 +1,608 @@
+/*
+ * uas-host.c -- Model of the USB host for UAS and Bulk-Only Transport
+ *
+ * Copyright (C) 2026 Free Software Initiative of Japan
+ *
+ * This file is a part of Fraucheky, making sure to have GNU GPL on a
+ * USB thumb drive
+ *
+ * Fraucheky is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Fraucheky is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * usb-msc.c runs as it is, with FRAUCHEKY_UAS, and this file is the
+ * host and the USB driver under it.  Endpoints are buffers given by
+ * usb_lld_tx_enable_buf and usb_lld_rx_enable_buf; the host moves a
+ * packet (of 64 bytes or less) and calls the callback of the
+ * endpoint, as the driver does.  The backend is a RAM disk of
+ * UAS_HOST_SECTORS sectors, sector N filled by N.
+ *
+ * The host drives commands queued on the command pipe, ABORT TASK,
+ * and switching back to Bulk-Only Transport, where a command failed
+ * by unit attention stalls the data pipe.  Output is a line for each
+ * check, and the last line is the number of bad ones.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "usb_lld.h"
+#include "msc.h"
+
+#define UAS_HOST_SECTORS 16
+#define PACKET_SIZE 64
+#define TIMEOUT_USEC 2000000
+
+#define ENDP_DATA 6		/* Bulk-Only, and data pipes of UAS */
+#define ENDP_UAS  7		/* Command and status pipes of UAS */
+
+#define IU_COMMAND         0x01
+#define IU_SENSE           0x03
+#define IU_RESPONSE        0x04
+#define IU_TASK_MANAGEMENT 0x05
+#define IU_READ_READY      0x06
+#define IU_WRITE_READY     0x07
+
+#define TMF_ABORT_TASK     0x01
+
+extern void fraucheky_main (void);
+extern void msc_uas_set (int on);
+extern void EP6_IN_Callback (uint16_t len);
+extern void EP6_OUT_Callback (uint16_t len);
+extern void EP7_IN_Callback (uint16_t len);
+extern void EP7_OUT_Callback (uint16_t len);
+
+const uint16_t rom_var = 1;
+int (*p_msc_scsi_discard) (uint32_t lba, uint32_t count);
+uint8_t msc_scsi_discard_zero;
+
+static uint8_t disk[UAS_HOST_SECTORS][MSC_SECTOR_SIZE];
+
+int
+msc_scsi_write (uint32_t lba, const uint8_t *buf, size_t size)
+{
+  if (lba >= UAS_HOST_SECTORS)
+    return SCSI_ERROR_ILLEAGAL_REQUEST;
+  memcpy (disk[lba], buf, size);
+  return 0;
+}
+
+int
+msc_scsi_read (uint32_t lba, const uint8_t **sector_p)
+{
+  if (lba >= UAS_HOST_SECTORS)
+    return SCSI_ERROR_ILLEAGAL_REQUEST;
+  *sector_p = disk[lba];
+  return 0;
+}
+
+int
+msc_scsi_lookup (uint32_t lba, const uint8_t **sector_p)
+{
+  (void)lba;
+  (void)sector_p;
+  return -1;
+}
+
+int
+msc_scsi_verify (uint32_t lba)
+{
+  return lba >= UAS_HOST_SECTORS ? SCSI_ERROR_ILLEAGAL_REQUEST : 0;
+}
+
+int
+msc_scsi_discard (uint32_t lba, uint32_t count)
+{
+  (void)lba;
+  (void)count;
+  return SCSI_ERROR_ILLEAGAL_REQUEST;
+}
+
+void
+msc_scsi_stop (uint8_t code)
+{
+  (void)code;
+}
+
+uint32_t
+msc_scsi_capacity (void)
+{
+  return UAS_HOST_SECTORS;
+}
+
+uint32_t
+msc_crc32 (const uint8_t *p, size_t n)
+{
+  uint32_t crc = 0xffffffff;
+  int i;
+
+  while (n--)
+    {
+      crc ^= *p++;
+      for (i = 0; i < 8; i++)
+	crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+
+  return ~crc;
+}
+
+
+/*
+ * Endpoints.  The buffer is given by the device, and it's taken by
+ * the host, with the lock.
+ */
+struct endp {
+  const uint8_t *tx;
+  size_t txlen;
+  uint8_t *rx;
+  size_t rxlen;
+  uint8_t tx_ready;
+  uint8_t rx_ready;
+  uint8_t stall_tx;
+  uint8_t stall_rx;
+};
+
+static pthread_mutex_t endp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct endp endp[8];
+
+void
+usb_lld_tx_enable_buf (int ep_num, const void *buf, size_t len)
+{
+  pthread_mutex_lock (&endp_mutex);
+  endp[ep_num].tx = buf;
+  endp[ep_num].txlen = len;
+  endp[ep_num].tx_ready = 1;
+  pthread_mutex_unlock (&endp_mutex);
+}
+
+void
+usb_lld_rx_enable_buf (int ep_num, void *buf, size_t len)
+{
+  pthread_mutex_lock (&endp_mutex);
+  endp[ep_num].rx = buf;
+  endp[ep_num].rxlen = len;
+  endp[ep_num].rx_ready = 1;
+  pthread_mutex_unlock (&endp_mutex);
+}
+
+void
+usb_lld_stall_tx (int ep_num)
+{
+  pthread_mutex_lock (&endp_mutex);
+  endp[ep_num].stall_tx = 1;
+  pthread_mutex_unlock (&endp_mutex);
+}
+
+void
+usb_lld_stall_rx (int ep_num)
+{
+  pthread_mutex_lock (&endp_mutex);
+  endp[ep_num].stall_rx = 1;
+  pthread_mutex_unlock (&endp_mutex);
+}
+
+/*
+ * Wait for the endpoint, and return with the lock.  When it's
+ * stalled, the host clears the halt, and it returns -2 without the
+ * lock.
+ */
+static int
+endp_wait (int ep_num, int in)
+{
+  struct endp *e = &endp[ep_num];
+  uint32_t usec = 0;
+
+  pthread_mutex_lock (&endp_mutex);
+  while (1)
+    {
+      if (in ? e->stall_tx : e->stall_rx)
+	{
+	  if (in)
+	    e->stall_tx = 0;
+	  else
+	    e->stall_rx = 0;
+	  pthread_mutex_unlock (&endp_mutex);
+	  return -2;
+	}
+      if (in ? e->tx_ready : e->rx_ready)
+	break;
+      pthread_mutex_unlock (&endp_mutex);
+      if (usec >= TIMEOUT_USEC)
+	return -1;
+      usleep (100);
+      usec += 100;
+      pthread_mutex_lock (&endp_mutex);
+    }
+
+  return 0;
+}
+
+/* Send a transfer of LEN bytes to the endpoint.  */
+static int
+host_out (int ep_num, const uint8_t *p, size_t len)
+{
+  size_t off = 0, n;
+  int r;
+
+  do
+    {
+      if ((r = endp_wait (ep_num, 0)) < 0)
+	return r;
+      n = len - off > PACKET_SIZE ? PACKET_SIZE : len - off;
+      if (n > endp[ep_num].rxlen)
+	n = endp[ep_num].rxlen;
+      memcpy (endp[ep_num].rx, p + off, n);
+      endp[ep_num].rx_ready = 0;
+      pthread_mutex_unlock (&endp_mutex);
+
+      if (ep_num == ENDP_DATA)
+	EP6_OUT_Callback (n);
+      else
+	EP7_OUT_Callback (n);
+      off += n;
+    }
+  while (n == PACKET_SIZE && off < len);
+
+  return 0;
+}
+
+/* Receive a transfer up to LEN bytes, until a short packet.  */
+static int
+host_in (int ep_num, uint8_t *p, size_t len)
+{
+  size_t off = 0, n;
+  int r;
+
+  do
+    {
+      if ((r = endp_wait (ep_num, 1)) < 0)
+	return r;
+      n = endp[ep_num].txlen;
+      if (n > len - off)
+	n = len - off;
+      memcpy (p + off, endp[ep_num].tx, n);
+      endp[ep_num].tx_ready = 0;
+      pthread_mutex_unlock (&endp_mutex);
+
+      if (ep_num == ENDP_DATA)
+	EP6_IN_Callback (n);
+      else
+	EP7_IN_Callback (n);
+      off += n;
+    }
+  while (n == PACKET_SIZE && off < len);
+
+  return off;
+}
+
+/*
+ * SET_INTERFACE: endpoints are configured again, and buffers given
+ * for the other alternate setting are no longer valid.
+ */
+static void
+host_set_alt (int uas)
+{
+  pthread_mutex_lock (&endp_mutex);
+  memset (endp, 0, sizeof endp);
+  pthread_mutex_unlock (&endp_mutex);
+  msc_uas_set (uas);
+}
+
+
+static int bad;
+
+static void
+check (int ok, const char *what)
+{
+  printf ("%s %s\n", ok ? "ok" : "BAD", what);
+  if (!ok)
+    bad++;
+}
+
+static void
+uas_command (uint16_t tag, const uint8_t *cdb, size_t len)
+{
+  uint8_t iu[32];
+
+  memset (iu, 0, sizeof iu);
+  iu[0] = IU_COMMAND;
+  iu[2] = tag >> 8;
+  iu[3] = tag;
+  memcpy (iu + 16, cdb, len);
+  host_out (ENDP_UAS, iu, sizeof iu);
+}
+
+static void
+uas_abort_task (uint16_t tag, uint16_t task_tag)
+{
+  uint8_t iu[16];
+
+  memset (iu, 0, sizeof iu);
+  iu[0] = IU_TASK_MANAGEMENT;
+  iu[2] = tag >> 8;
+  iu[3] = tag;
+  iu[4] = TMF_ABORT_TASK;
+  iu[6] = task_tag >> 8;
+  iu[7] = task_tag;
+  host_out (ENDP_UAS, iu, sizeof iu);
+}
+
+/* Receive an IU on the status pipe, and check its ID and tag.  */
+static int
+uas_iu (uint8_t *iu, uint8_t id, uint16_t tag)
+{
+  int n = host_in (ENDP_UAS, iu, PACKET_SIZE);
+
+  return n >= 4 && iu[0] == id && ((iu[2] << 8) | iu[3]) == tag;
+}
+
+/* Receive the status of TAG, and return SCSI status (-1 on error).  */
+static int
+uas_status (uint16_t tag, uint8_t *sense_key_p, uint8_t *asc_p)
+{
+  uint8_t iu[PACKET_SIZE];
+
+  if (!uas_iu (iu, IU_SENSE, tag))
+    return -1;
+  if (iu[6] != 0 && ((iu[14] << 8) | iu[15]) >= 14)
+    {
+      *sense_key_p = iu[16 + 2] & 0x0f;
+      *asc_p = iu[16 + 12];
+    }
+
+  return iu[6];
+}
+
+static void
+read10_cdb (uint8_t *cdb, uint32_t lba, uint16_t count)
+{
+  memset (cdb, 0, 10);
+  cdb[0] = 0x28;
+  cdb[2] = lba >> 24;
+  cdb[3] = lba >> 16;
+  cdb[4] = lba >> 8;
+  cdb[5] = lba;
+  cdb[7] = count >> 8;
+  cdb[8] = count;
+}
+
+/* Data of READ(10) from LBA, against the RAM disk.  */
+static int
+read_data_ok (const uint8_t *p, int n, uint32_t lba, uint16_t count)
+{
+  int i;
+
+  if (n != count * MSC_SECTOR_SIZE)
+    return 0;
+
+  for (i = 0; i < n; i++)
+    if (p[i] != disk[lba + i / MSC_SECTOR_SIZE][i % MSC_SECTOR_SIZE])
+      return 0;
+
+  return 1;
+}
+
+static void
+uas_main (void)
+{
+  static uint8_t data[4 * MSC_SECTOR_SIZE];
+  uint8_t iu[PACKET_SIZE];
+  uint8_t cdb[16];
+  uint8_t key = 0, asc = 0;
+  int n;
+
+  host_set_alt (1);
+
+  /* INQUIRY */
+  memset (cdb, 0, sizeof cdb);
+  cdb[0] = 0x12;
+  cdb[4] = 36;
+  uas_command (1, cdb, 6);
+  check (uas_iu (iu, IU_READ_READY, 1), "INQUIRY: read ready");
+  n = host_in (ENDP_DATA, data, 36);
+  check (n == 36 && data[0] == 0x00, "INQUIRY: data");
+  check (uas_status (1, &key, &asc) == 0, "INQUIRY: status");
+
+  /* Unit attention is reported by TEST UNIT READY, with the status.  */
+  memset (cdb, 0, sizeof cdb);
+  uas_command (2, cdb, 6);
+  check (uas_status (2, &key, &asc) == 2 && key == 0x06,
+	 "TEST UNIT READY: unit attention");
+  uas_command (3, cdb, 6);
+  check (uas_status (3, &key, &asc) == 0, "TEST UNIT READY: good");
+
+  /* READ(10) queued after another, before its status.  */
+  read10_cdb (cdb, 0, 2);
+  uas_command (4, cdb, 10);
+  read10_cdb (cdb, 2, 1);
+  uas_command (5, cdb, 10);
+  check (uas_iu (iu, IU_READ_READY, 4), "READ(10) queued: first ready");
+  n = host_in (ENDP_DATA, data, 2 * MSC_SECTOR_SIZE);
+  check (read_data_ok (data, n, 0, 2), "READ(10) queued: first data");
+  check (uas_status (4, &key, &asc) == 0, "READ(10) queued: first status");
+  check (uas_iu (iu, IU_READ_READY, 5), "READ(10) queued: second ready");
+  n = host_in (ENDP_DATA, data, MSC_SECTOR_SIZE);
+  check (read_data_ok (data, n, 2, 1), "READ(10) queued: second data");
+  check (uas_status (5, &key, &asc) == 0, "READ(10) queued: second status");
+
+  /* WRITE(10) */
+  memset (cdb, 0, sizeof cdb);
+  cdb[0] = 0x2a;
+  cdb[5] = 1;
+  cdb[8] = 1;
+  uas_command (6, cdb, 10);
+  check (uas_iu (iu, IU_WRITE_READY, 6), "WRITE(10): write ready");
+  memset (data, 0xab, MSC_SECTOR_SIZE);
+  host_out (ENDP_DATA, data, MSC_SECTOR_SIZE);
+  check (uas_status (6, &key, &asc) == 0, "WRITE(10): status");
+  check (disk[1][0] == 0xab && disk[1][MSC_SECTOR_SIZE - 1] == 0xab,
+	 "WRITE(10): written");
+
+  /*
+   * ABORT TASK of the command queued behind READ(10) in progress.
+   * READ(10) completes, and the aborted one has no status.
+   */
+  read10_cdb (cdb, 3, 1);
+  uas_command (7, cdb, 10);
+  check (uas_iu (iu, IU_READ_READY, 7), "ABORT TASK: read ready");
+  memset (cdb, 0, sizeof cdb);
+  uas_command (8, cdb, 6);
+  uas_abort_task (9, 8);
+  n = host_in (ENDP_DATA, data, MSC_SECTOR_SIZE);
+  check (read_data_ok (data, n, 3, 1), "ABORT TASK: data");
+  check (uas_status (7, &key, &asc) == 0, "ABORT TASK: status");
+  check (uas_iu (iu, IU_RESPONSE, 9) && iu[7] == 0x00, "ABORT TASK: response");
+  uas_command (10, cdb, 6);
+  check (uas_status (10, &key, &asc) == 0, "ABORT TASK: next command");
+
+  /* Errors are reported with sense data, and REQUEST SENSE has none.  */
+  memset (cdb, 0, sizeof cdb);
+  cdb[0] = 0xc0;
+  uas_command (11, cdb, 6);
+  check (uas_status (11, &key, &asc) == 2 && key == 0x05 && asc == 0x20,
+	 "unknown command: INVALID COMMAND OPERATION CODE");
+  read10_cdb (cdb, UAS_HOST_SECTORS + 4, 1);
+  uas_command (12, cdb, 10);
+  check (uas_status (12, &key, &asc) == 2 && key == 0x05 && asc == 0x21,
+	 "READ(10) out of range: LOGICAL BLOCK ADDRESS OUT OF RANGE");
+  memset (cdb, 0, sizeof cdb);
+  cdb[0] = 0x03;
+  cdb[4] = 18;
+  uas_command (13, cdb, 6);
+  check (uas_iu (iu, IU_READ_READY, 13), "REQUEST SENSE: read ready");
+  n = host_in (ENDP_DATA, data, 18);
+  check (n == 18 && (data[2] & 0x0f) == 0x00, "REQUEST SENSE: no sense");
+  check (uas_status (13, &key, &asc) == 0, "REQUEST SENSE: status");
+}
+
+/* CBW of data-in command, with CDB of LEN bytes.  */
+static int
+bot_command (uint8_t tag, uint32_t length, const uint8_t *cdb, size_t len)
+{
+  uint8_t cbw[31];
+
+  memset (cbw, 0, sizeof cbw);
+  memcpy (cbw, "USBC", 4);
+  cbw[4] = tag;
+  cbw[8] = length;
+  cbw[9] = length >> 8;
+  cbw[12] = 0x80;		/* IN */
+  cbw[14] = len;
+  memcpy (cbw + 15, cdb, len);
+  return host_out (ENDP_DATA, cbw, sizeof cbw);
+}
+
+/* Receive CSW, and check its tag.  Return the status, or -1.  */
+static int
+bot_csw (uint8_t tag, uint32_t *residue_p)
+{
+  uint8_t csw[13];
+
+  if (host_in (ENDP_DATA, csw, sizeof csw) != sizeof csw
+      || memcmp (csw, "USBS", 4) || csw[4] != tag)
+    return -1;
+  *residue_p = csw[8] | (csw[9] << 8) | (csw[10] << 16) | (csw[11] << 24);
+  return csw[12];
+}
+
+static struct msc_medium bot_medium = {
+  UAS_HOST_SECTORS, msc_scsi_read, msc_scsi_write, msc_scsi_verify,
+  NULL, NULL, NULL, 0
+};
+
+static void
+bot_main (void)
+{
+  static uint8_t data[MSC_SECTOR_SIZE];
+  uint8_t cdb[10];
+  uint32_t residue;
+  int n;
+
+  host_set_alt (0);
+
+  memset (cdb, 0, sizeof cdb);
+  cdb[0] = 0x12;		/* INQUIRY */
+  cdb[4] = 36;
+  check (bot_command (0x21, 36, cdb, 6) == 0, "BOT INQUIRY: CBW");
+  n = host_in (ENDP_DATA, data, 36);
+  check (n == 36 && data[0] == 0x00, "BOT INQUIRY: data");
+  check (bot_csw (0x21, &residue) == 0, "BOT INQUIRY: CSW");
+
+  /* Unit attention fails READ(10): no data, and bulk-IN is stalled.  */
+  msc_media_swap (&bot_medium);
+  memset (cdb, 0, sizeof cdb);
+  cdb[0] = 0x28;		/* READ(10) */
+  cdb[8] = 1;
+  check (bot_command (0x22, MSC_SECTOR_SIZE, cdb, 10) == 0,
+	 "BOT READ(10) unit attention: CBW");
+  check (host_in (ENDP_DATA, data, MSC_SECTOR_SIZE) == -2,
+	 "BOT READ(10) unit attention: stall");
+  check (bot_csw (0x22, &residue) == 1 && residue == MSC_SECTOR_SIZE,
+	 "BOT READ(10) unit attention: CSW");
+
+  /* INQUIRY keeps the sense data for REQUEST SENSE.  */
+  memset (cdb, 0, sizeof cdb);
+  cdb[0] = 0x12;		/* INQUIRY */
+  cdb[4] = 36;
+  bot_command (0x23, 36, cdb, 6);
+  n = host_in (ENDP_DATA, data, 36);
+  check (n == 36 && bot_csw (0x23, &residue) == 0,
+	 "BOT INQUIRY after unit attention");
+  memset (cdb, 0, sizeof cdb);
+  cdb[0] = 0x03;		/* REQUEST SENSE */
+  cdb[4] = 18;
+  bot_command (0x24, 18, cdb, 6);
+  n = host_in (ENDP_DATA, data, 18);
+  check (n == 18 && (data[2] & 0x0f) == 0x06 && data[12] == 0x28
+	 && bot_csw (0x24, &residue) == 0,
+	 "BOT REQUEST SENSE: unit attention");
+}
+
+static void *
+device (void *arg)
+{
+  (void)arg;
+  fraucheky_main ();
+  return NULL;
+}
+
+int
+main (void)
+{
+  pthread_t thd;
+  int i;
+
+  for (i = 0; i < UAS_HOST_SECTORS; i++)
+    memset (disk[i], i, MSC_SECTOR_SIZE);
+
+  pthread_create (&thd, NULL, device, NULL);
+  /* Wait for the CBW to be received.  */
+  if (endp_wait (ENDP_DATA, 0) < 0)
+    {
+      fputs ("uas-host: device doesn't start\n", stderr);
+      exit (1);
+    }
+  pthread_mutex_unlock (&endp_mutex);
+
+  uas_main ();
+  bot_main ();
+
+  printf ("bad %d\n", bad);
+  return bad != 0;
+}
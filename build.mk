@@ -20,6 +20,33 @@ $(BUILDDIR)/README.o: README
 $(BUILDDIR)/INDEX.o: INDEX
 	$(OBJCOPY_BINARY_DATA) $< $@
 
+$(BUILDDIR)/SECTORS.o: SECTORS
+	$(OBJCOPY_BINARY_DATA) $< $@
+
+# Report of RAM and ROM usage of each module.
+# When FRAUCHEKY_RAM_LIMIT is specified, it's done at build, and
+# the build fails if RAM usage exceeds the limit.
+SIZE ?= $(CROSS)size
+
+FRAUCHEKY_OBJS = $(BUILDDIR)/fraucheky.o $(BUILDDIR)/usb-msc.o \
+		 $(BUILDDIR)/disk-on-rom.o $(FRAUCHEKY_BLOBS)
+
+.PHONY: fraucheky-footprint
+fraucheky-footprint: $(FRAUCHEKY_OBJS)
+	@$(SIZE) $^ | awk -v limit=$(FRAUCHEKY_RAM_LIMIT) '		\
+	  NR > 1 {							\
+	    rom += $$1 + $$2; ram += $$2 + $$3;				\
+	    printf "%-32s ROM %6d RAM %6d\n", $$6, $$1 + $$2, $$2 + $$3 } \
+	  END {								\
+	    printf "%-32s ROM %6d RAM %6d\n", "Fraucheky total", rom, ram; \
+	    if (limit != "" && ram > limit) {				\
+	      printf "RAM usage exceeds the limit: %d\n", limit;	\
+	      exit 1 } }'
+
+ifneq ($(FRAUCHEKY_RAM_LIMIT),)
+all: fraucheky-footprint
+endif
+
 distclean::
-	-rm -f README INDEX COPYING \
+	-rm -f README INDEX COPYING SECTORS \
 	       fraucheky-vid-pid-ver.c.inc fraucheky-usb-strings.c.inc disk-on-rom.h
@@ -0,0 +1,315 @@
+/*
+ * disk-crypt.c -- Encryption of sectors
+ *
+ * Copyright (C) 2026 Free Software Initiative of Japan
+ *
+ * This file is a part of Fraucheky, GNU GPL in a USB thumb drive
+ *
+ * Fraucheky is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Fraucheky is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Sectors on the backend are encrypted by ChaCha20 with 256-bit key,
+ * as a stream cipher tweaked by the sector: the nonce is the LBA, and
+ * the block counter starts from 0 for each sector.  The medium of the
+ * backend is wrapped, and the application switches the medium by:
+ *
+ *     msc_media_swap (fraucheky_crypt_medium (NULL, key));
+ *
+ * Encryption (and decryption) is XOR by the keystream of the sector.
+ * After a sector is read (or written), the keystream of the next
+ * sector is computed by a thread, while the sector is sent to the
+ * host (or the next sector is received), so that sequential access
+ * costs one XOR for each sector.
+ *
+ * The volume on ROM is encrypted by configure with FRAUCHEKY_CRYPT_KEY
+ * (sectors of files), and by p_msc_rom_seal here (sectors generated
+ * by disk-on-rom.c), with the same key.
+ *
+ * Note that a sector written again uses the same keystream.  It's
+ * for the volume shipped with confidential data, not for the storage
+ * of which versions can be observed by others.
+ */
+
+#ifdef FRAUCHEKY_CRYPT
+#include <stdint.h>
+#include <string.h>
+#include <chopstx.h>
+
+#include "config.h"
+#include "msc.h"
+
+extern int msc_scsi_write (uint32_t lba, const uint8_t *buf, size_t size);
+extern int msc_scsi_read (uint32_t lba, const uint8_t **sector_p);
+extern int msc_scsi_verify (uint32_t lba);
+extern uint32_t msc_scsi_capacity (void);
+extern void (*p_msc_rom_seal) (uint32_t lba, uint8_t *sector);
+
+#ifndef PRIO_DISK_CRYPT
+#define PRIO_DISK_CRYPT 2
+#endif
+
+#ifndef DISK_CRYPT_STACK_SIZE
+#define DISK_CRYPT_STACK_SIZE 1024
+#endif
+
+#define CRYPT_LBA_NONE 0xffffffff
+
+static uint32_t crypt_key[8];
+static const struct msc_medium *crypt_backend;
+static struct msc_medium crypt_medium;
+static struct msc_medium crypt_default;
+
+/*
+ * Keystream buffers.  The MSC thread uses crypt_ks[crypt_cur], and
+ * the thread computes the next one into the other.
+ */
+static uint8_t crypt_ks[2][MSC_SECTOR_SIZE] __attribute__ ((aligned (4)));
+static uint32_t crypt_ks_lba[2];
+static uint8_t crypt_cur;
+static uint8_t crypt_buf[MSC_SECTOR_SIZE] __attribute__ ((aligned (4)));
+
+static chopstx_mutex_t crypt_mutex;
+static chopstx_cond_t crypt_cond;
+static uint32_t crypt_work_lba;
+static uint8_t crypt_work;	/* The thread is computing.  */
+static chopstx_t crypt_thd;
+static uint8_t crypt_stack[DISK_CRYPT_STACK_SIZE];
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d)			\
+  do {							\
+    a += b; d ^= a; d = ROTL (d, 16);			\
+    c += d; b ^= c; b = ROTL (b, 12);			\
+    a += b; d ^= a; d = ROTL (d, 8);			\
+    c += d; b ^= c; b = ROTL (b, 7);			\
+  } while (0)
+
+static void
+put_le32 (uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/* ChaCha20 block of COUNTER, with the nonce of LBA, to OUT.  */
+static void
+chacha20_block (uint8_t *out, uint32_t lba, uint32_t counter)
+{
+  uint32_t in[16], x[16];
+  int i;
+
+  in[0] = 0x61707865;		/* "expand 32-byte k" */
+  in[1] = 0x3320646e;
+  in[2] = 0x79622d32;
+  in[3] = 0x6b206574;
+  memcpy (in + 4, crypt_key, sizeof crypt_key);
+  in[12] = counter;
+  in[13] = lba;
+  in[14] = 0;
+  in[15] = 0;
+
+  memcpy (x, in, sizeof x);
+  for (i = 0; i < 10; i++)
+    {
+      QUARTERROUND (x[0], x[4], x[8], x[12]);
+      QUARTERROUND (x[1], x[5], x[9], x[13]);
+      QUARTERROUND (x[2], x[6], x[10], x[14]);
+      QUARTERROUND (x[3], x[7], x[11], x[15]);
+      QUARTERROUND (x[0], x[5], x[10], x[15]);
+      QUARTERROUND (x[1], x[6], x[11], x[12]);
+      QUARTERROUND (x[2], x[7], x[8], x[13]);
+      QUARTERROUND (x[3], x[4], x[9], x[14]);
+    }
+
+  for (i = 0; i < 16; i++)
+    put_le32 (out + i * 4, x[i] + in[i]);
+}
+
+static void
+crypt_keystream (uint8_t *ks, uint32_t lba)
+{
+  uint32_t i;
+
+  for (i = 0; i < MSC_SECTOR_SIZE / 64; i++)
+    chacha20_block (ks + i * 64, lba, i);
+}
+
+static void *
+crypt_main (void *arg)
+{
+  uint32_t lba;
+  uint8_t spare;
+
+  (void)arg;
+
+  while (1)
+    {
+      chopstx_mutex_lock (&crypt_mutex);
+      while (!crypt_work)
+	chopstx_cond_wait (&crypt_cond, &crypt_mutex);
+      lba = crypt_work_lba;
+      spare = crypt_cur ^ 1;
+      crypt_ks_lba[spare] = CRYPT_LBA_NONE;
+      chopstx_mutex_unlock (&crypt_mutex);
+
+      crypt_keystream (crypt_ks[spare], lba);
+
+      chopstx_mutex_lock (&crypt_mutex);
+      crypt_ks_lba[spare] = lba;
+      crypt_work = 0;
+      chopstx_cond_signal (&crypt_cond);
+      chopstx_mutex_unlock (&crypt_mutex);
+    }
+
+  return NULL;
+}
+
+/* Keystream of LBA, by the thread or computed here.  */
+static const uint8_t *
+crypt_keystream_get (uint32_t lba)
+{
+  chopstx_mutex_lock (&crypt_mutex);
+  while (crypt_work)
+    chopstx_cond_wait (&crypt_cond, &crypt_mutex);
+  if (crypt_ks_lba[crypt_cur ^ 1] == lba)
+    crypt_cur ^= 1;
+  chopstx_mutex_unlock (&crypt_mutex);
+
+  if (crypt_ks_lba[crypt_cur] != lba)
+    {
+      crypt_keystream (crypt_ks[crypt_cur], lba);
+      crypt_ks_lba[crypt_cur] = lba;
+    }
+
+  return crypt_ks[crypt_cur];
+}
+
+static void
+crypt_xor (uint8_t *d, const uint8_t *p, const uint8_t *ks)
+{
+  uint32_t i;
+
+  if ((((uintptr_t)d | (uintptr_t)p) & 3) == 0)
+    for (i = 0; i < MSC_SECTOR_SIZE / 4; i++)
+      ((uint32_t *)d)[i] = ((const uint32_t *)p)[i]
+	^ ((const uint32_t *)ks)[i];
+  else
+    for (i = 0; i < MSC_SECTOR_SIZE; i++)
+      d[i] = p[i] ^ ks[i];
+}
+
+/*
+ * XOR the keystream of LBA to the sector P, into crypt_buf.  Then,
+ * let the thread compute the keystream of the next sector.
+ */
+static void
+crypt_sector (uint32_t lba, const uint8_t *p)
+{
+  crypt_xor (crypt_buf, p, crypt_keystream_get (lba));
+
+  chopstx_mutex_lock (&crypt_mutex);
+  crypt_work_lba = lba + 1;
+  crypt_work = 1;
+  chopstx_cond_signal (&crypt_cond);
+  chopstx_mutex_unlock (&crypt_mutex);
+}
+
+/*
+ * Encrypt the sector generated by disk-on-rom.c in place.  The
+ * keystream is kept for crypt_sector of the read, which follows.
+ */
+static void
+crypt_rom_seal (uint32_t lba, uint8_t *sector)
+{
+  crypt_xor (sector, sector, crypt_keystream_get (lba));
+}
+
+static int
+crypt_scsi_read (uint32_t lba, const uint8_t **sector_p)
+{
+  const uint8_t *p;
+  int r;
+
+  r = (*crypt_backend->read) (lba, &p);
+  if (r)
+    return r;
+
+  crypt_sector (lba, p);
+  *sector_p = crypt_buf;
+  return 0;
+}
+
+static int
+crypt_scsi_write (uint32_t lba, const uint8_t *buf, size_t size)
+{
+  if (size != MSC_SECTOR_SIZE)
+    return SCSI_ERROR_ILLEAGAL_REQUEST;
+
+  crypt_sector (lba, buf);
+  return (*crypt_backend->write) (lba, crypt_buf, size);
+}
+
+/*
+ * Return the medium of M encrypted by KEY (32 bytes).  When M is
+ * NULL, it's the backend of msc_scsi_read and msc_scsi_write, and
+ * sectors generated by disk-on-rom.c are encrypted, too.  M
+ * should have neither SUBMIT nor DISCARD (a discarded sector wouldn't
+ * read as zeros).  It should be called before msc_media_swap, not
+ * while the medium is used.
+ */
+const struct msc_medium *
+fraucheky_crypt_medium (const struct msc_medium *m, const uint8_t *key)
+{
+  int i;
+
+  if (m == NULL)
+    {
+      crypt_default.nblocks = msc_scsi_capacity ();
+      crypt_default.read = msc_scsi_read;
+      crypt_default.write = msc_scsi_write;
+      crypt_default.verify = msc_scsi_verify;
+      m = &crypt_default;
+      p_msc_rom_seal = crypt_rom_seal;
+    }
+
+  crypt_backend = m;
+  for (i = 0; i < 8; i++)
+    crypt_key[i] = key[i * 4] | (key[i * 4 + 1] << 8)
+      | (key[i * 4 + 2] << 16) | ((uint32_t)key[i * 4 + 3] << 24);
+  crypt_ks_lba[0] = crypt_ks_lba[1] = CRYPT_LBA_NONE;
+
+  crypt_medium.nblocks = m->nblocks;
+  crypt_medium.read = crypt_scsi_read;
+  crypt_medium.write = m->write ? crypt_scsi_write : NULL;
+  crypt_medium.verify = m->verify;
+  crypt_medium.discard = NULL;
+  crypt_medium.submit = NULL;
+  crypt_medium.lookup = NULL;
+  crypt_medium.discard_zero = 0;
+
+  if (!crypt_thd)
+    {
+      chopstx_mutex_init (&crypt_mutex);
+      chopstx_cond_init (&crypt_cond);
+      crypt_thd = chopstx_create (PRIO_DISK_CRYPT, (uintptr_t)crypt_stack,
+				  sizeof crypt_stack, crypt_main, NULL);
+    }
+
+  return &crypt_medium;
+}
+#endif
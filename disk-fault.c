@@ -0,0 +1,381 @@
+/*
+ * disk-fault.c -- Fault injection, for GNU/Linux emulation
+ *
+ * Copyright (C) 2026 Free Software Initiative of Japan
+ *
+ * This file is a part of Fraucheky, GNU GPL in a USB thumb drive
+ *
+ * Fraucheky is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Fraucheky is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Faults are injected to the backend (msc_scsi_read, msc_scsi_write)
+ * and to packets of the endpoint, by a script, so that recovery of
+ * the host can be measured with the emulation.  The script is rules,
+ * separated by newline or ';':
+ *
+ *   EVENT FIRST COUNT ACTION [ARG]
+ *
+ * EVENT is "read" or "write" of the backend, or "in" or "out" of
+ * packets.  Events are counted from 0 for each kind, and the rule
+ * applies to COUNT events from FIRST (COUNT 0 means all following).
+ * ACTION is one of:
+ *
+ *   delay USEC       wait USEC, then go on
+ *   error SENSE      fail by SENSE: not-ready, data-protect,
+ *                    medium-error or illegal-request (read and write)
+ *   short LEN        send LEN bytes only, which ends the transfer (in)
+ *   drop             lose the packet (in and out)
+ *
+ * For example, "out 0 1 drop; read 100 5 error medium-error".  A
+ * dropped OUT packet makes the bad CBW (STALL) or the erroneous
+ * packet of WRITE(10), and a dropped IN packet makes the host time
+ * out.
+ *
+ * Time to recovery is measured from an injected fault to the end of
+ * the next command which passed.  Faults while recovering are counted
+ * into the same recovery.
+ */
+
+#ifdef GNU_LINUX_EMULATION
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <chopstx.h>
+
+#include "config.h"
+#include "msc.h"
+
+extern int (*p_msc_scsi_write) (uint32_t lba, const uint8_t *buf, size_t size);
+extern int (*p_msc_scsi_read) (uint32_t lba, const uint8_t **sector_p);
+extern int (*p_msc_scsi_lookup) (uint32_t lba, const uint8_t **sector_p);
+extern int msc_rom_write (uint32_t lba, const uint8_t *buf, size_t size);
+extern int msc_rom_read (uint32_t lba, const uint8_t **sector_p);
+extern int (*p_msc_packet_fault) (int in, size_t len);
+extern void (*p_msc_command_done) (int status);
+
+#ifndef FAULT_RULES_MAX
+#define FAULT_RULES_MAX 16
+#endif
+
+enum fault_event { FAULT_READ, FAULT_WRITE, FAULT_IN, FAULT_OUT, FAULT_EVENTS };
+enum fault_action { FAULT_DELAY, FAULT_ERROR, FAULT_SHORT, FAULT_DROP };
+
+static const char *fault_event_name[FAULT_EVENTS] = {
+  "read", "write", "in", "out"
+};
+
+struct fault_rule {
+  uint8_t event;
+  uint8_t action;
+  uint32_t first;
+  uint32_t count;
+  uint32_t arg;
+};
+
+static struct fault_rule fault_rules[FAULT_RULES_MAX];
+static unsigned int fault_rules_num;
+static uint32_t fault_count[FAULT_EVENTS];
+
+/* Hooks wrapped by this.  */
+static int (*fault_next_read) (uint32_t lba, const uint8_t **sector_p);
+static int (*fault_next_write) (uint32_t lba, const uint8_t *buf, size_t size);
+static int (*fault_next_lookup) (uint32_t lba, const uint8_t **sector_p);
+static int fault_active;
+
+static chopstx_mutex_t fault_mutex;
+static uint64_t fault_start_usec;   /* Recovering, when non-zero.  */
+static uint32_t fault_injected;
+static uint32_t fault_recovered;
+static uint64_t fault_total_usec;
+static uint32_t fault_max_usec;
+
+static uint64_t
+fault_clock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Count an EVENT and find the rule for it.  It returns the rule, or
+ * NULL for no fault.  A delay is done here.
+ */
+static const struct fault_rule *
+fault_check (enum fault_event event)
+{
+  const struct fault_rule *rule = NULL;
+  uint32_t n;
+  unsigned int i;
+
+  chopstx_mutex_lock (&fault_mutex);
+  n = fault_count[event]++;
+  for (i = 0; i < fault_rules_num; i++)
+    if (fault_rules[i].event == event && n >= fault_rules[i].first
+	&& (fault_rules[i].count == 0
+	    || n - fault_rules[i].first < fault_rules[i].count))
+      {
+	rule = &fault_rules[i];
+	fault_injected++;
+	if (fault_start_usec == 0)
+	  fault_start_usec = fault_clock ();
+	break;
+      }
+  chopstx_mutex_unlock (&fault_mutex);
+
+  if (rule && rule->action == FAULT_DELAY)
+    {
+      chopstx_usec_wait (rule->arg);
+      return NULL;
+    }
+
+  return rule;
+}
+
+static int
+fault_scsi_read (uint32_t lba, const uint8_t **sector_p)
+{
+  const struct fault_rule *rule = fault_check (FAULT_READ);
+
+  if (rule)
+    return rule->arg;
+
+  if (fault_next_read)
+    return (*fault_next_read) (lba, sector_p);
+
+  return msc_rom_read (lba, sector_p);
+}
+
+static int
+fault_scsi_write (uint32_t lba, const uint8_t *buf, size_t size)
+{
+  const struct fault_rule *rule = fault_check (FAULT_WRITE);
+
+  if (rule)
+    return rule->arg;
+
+  if (fault_next_write)
+    return (*fault_next_write) (lba, buf, size);
+
+  return msc_rom_write (lba, buf, size);
+}
+
+static int
+fault_packet (int in, size_t len)
+{
+  const struct fault_rule *rule = fault_check (in ? FAULT_IN : FAULT_OUT);
+
+  if (rule == NULL)
+    return len;
+  else if (rule->action == FAULT_DROP)
+    return -1;
+  else
+    return rule->arg < len ? rule->arg : len;
+}
+
+static void
+fault_command_done (int status)
+{
+  uint64_t usec;
+
+  chopstx_mutex_lock (&fault_mutex);
+  if (fault_start_usec && status == MSC_CSW_STATUS_PASSED)
+    {
+      usec = fault_clock () - fault_start_usec;
+      fault_start_usec = 0;
+      fault_recovered++;
+      fault_total_usec += usec;
+      if (usec > fault_max_usec)
+	fault_max_usec = usec;
+    }
+  chopstx_mutex_unlock (&fault_mutex);
+}
+
+static int
+fault_sense (const char *name, uint32_t *arg_p)
+{
+  if (!strcmp (name, "not-ready"))
+    *arg_p = SCSI_ERROR_NOT_READY;
+  else if (!strcmp (name, "data-protect"))
+    *arg_p = SCSI_ERROR_DATA_PROTECT;
+  else if (!strcmp (name, "medium-error"))
+    *arg_p = SCSI_ERROR_MEDIUM_ERROR;
+  else if (!strcmp (name, "illegal-request"))
+    *arg_p = SCSI_ERROR_ILLEAGAL_REQUEST;
+  else
+    return -1;
+
+  return 0;
+}
+
+/* Parse a rule of words in WORD[0..N-1].  */
+static int
+fault_parse_rule (char **word, int n, struct fault_rule *rule)
+{
+  char *end;
+  int i;
+
+  if (n < 4)
+    return -1;
+
+  for (i = 0; i < FAULT_EVENTS; i++)
+    if (!strcmp (word[0], fault_event_name[i]))
+      break;
+  if (i == FAULT_EVENTS)
+    return -1;
+  rule->event = i;
+
+  rule->first = strtoul (word[1], &end, 0);
+  if (*end)
+    return -1;
+  rule->count = strtoul (word[2], &end, 0);
+  if (*end)
+    return -1;
+
+  rule->arg = 0;
+  if (!strcmp (word[3], "delay") && n == 5)
+    {
+      rule->action = FAULT_DELAY;
+      rule->arg = strtoul (word[4], &end, 0);
+      return *end ? -1 : 0;
+    }
+  else if (!strcmp (word[3], "error") && n == 5
+	   && (rule->event == FAULT_READ || rule->event == FAULT_WRITE))
+    {
+      rule->action = FAULT_ERROR;
+      return fault_sense (word[4], &rule->arg);
+    }
+  else if (!strcmp (word[3], "short") && n == 5 && rule->event == FAULT_IN)
+    {
+      rule->action = FAULT_SHORT;
+      rule->arg = strtoul (word[4], &end, 0);
+      return *end ? -1 : 0;
+    }
+  else if (!strcmp (word[3], "drop") && n == 4
+	   && (rule->event == FAULT_IN || rule->event == FAULT_OUT))
+    {
+      rule->action = FAULT_DROP;
+      return 0;
+    }
+
+  return -1;
+}
+
+static int
+fault_parse (const char *script)
+{
+  char line[128];
+  char *word[5];
+  const char *p, *q;
+  char *s;
+  int n;
+
+  fault_rules_num = 0;
+  for (p = script; *p; p = *q ? q + 1 : q)
+    {
+      q = p + strcspn (p, ";\n");
+      if ((size_t)(q - p) >= sizeof line)
+	return -1;
+      memcpy (line, p, q - p);
+      line[q - p] = '\0';
+
+      n = 0;
+      for (s = strtok (line, " \t"); s; s = strtok (NULL, " \t"))
+	if (n < 5)
+	  word[n++] = s;
+	else
+	  return -1;
+
+      if (n == 0)
+	continue;
+      if (fault_rules_num >= FAULT_RULES_MAX
+	  || fault_parse_rule (word, n, &fault_rules[fault_rules_num]) < 0)
+	return -1;
+      fault_rules_num++;
+    }
+
+  return 0;
+}
+
+void
+fraucheky_fault_stop (void)
+{
+  if (!fault_active)
+    return;
+
+  p_msc_scsi_read = fault_next_read;
+  p_msc_scsi_write = fault_next_write;
+  p_msc_scsi_lookup = fault_next_lookup;
+  p_msc_packet_fault = NULL;
+  p_msc_command_done = NULL;
+  fault_active = 0;
+}
+
+/*
+ * Start fault injection by SCRIPT.  When SCRIPT is NULL, it's taken
+ * from the environment variable FRAUCHEKY_FAULT (nothing is done, if
+ * it's not defined).  It should be called after the backend is set
+ * up (e.g. fraucheky_file_open).  It returns 0 on success, -1 on
+ * error of the script.
+ */
+int
+fraucheky_fault_start (const char *script)
+{
+  if (script == NULL && (script = getenv ("FRAUCHEKY_FAULT")) == NULL)
+    return 0;
+
+  fraucheky_fault_stop ();
+  if (fault_parse (script) < 0)
+    return -1;
+
+  chopstx_mutex_init (&fault_mutex);
+  memset (fault_count, 0, sizeof fault_count);
+  fault_start_usec = 0;
+  fault_injected = fault_recovered = 0;
+  fault_total_usec = 0;
+  fault_max_usec = 0;
+
+  fault_next_read = p_msc_scsi_read;
+  fault_next_write = p_msc_scsi_write;
+  fault_next_lookup = p_msc_scsi_lookup;
+  p_msc_scsi_read = fault_scsi_read;
+  p_msc_scsi_write = fault_scsi_write;
+  /* All sectors go through fault_scsi_read.  */
+  p_msc_scsi_lookup = NULL;
+  p_msc_packet_fault = fault_packet;
+  p_msc_command_done = fault_command_done;
+  fault_active = 1;
+  return 0;
+}
+
+/*
+ * Statistics: number of injected faults, number of recoveries, and
+ * the maximum and the average of time to recovery in microseconds.
+ * It should be called after fraucheky_fault_stop (or, the numbers
+ * may be inconsistent).
+ */
+void
+fraucheky_fault_stats (uint32_t *injected_p, uint32_t *recovered_p,
+		       uint32_t *max_usec_p, uint32_t *avg_usec_p)
+{
+  *injected_p = fault_injected;
+  *recovered_p = fault_recovered;
+  *max_usec_p = fault_max_usec;
+  *avg_usec_p = fault_recovered ? fault_total_usec / fault_recovered : 0;
+}
+#endif
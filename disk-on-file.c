@@ -0,0 +1,200 @@
+/*
+ * disk-on-file.c -- Storage by an image file, for GNU/Linux emulation
+ *
+ * Copyright (C) 2026 Free Software Initiative of Japan
+ *
+ * This file is a part of Fraucheky, GNU GPL in a USB thumb drive
+ *
+ * Fraucheky is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Fraucheky is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * An image file (e.g. made by mkfs.fat) is mapped into memory, and
+ * the volume is served from the mapping, instead of the volume on
+ * ROM.  Sectors are read from the mapping directly without copy.
+ * When it's opened for writing, written sectors go to the file, and
+ * discarded sectors are cleared.
+ *
+ * The size of the image should be a multiple of MSC_SECTOR_SIZE.
+ * fraucheky_file_open should be called before fraucheky_main (or
+ * msc_init), so that the capacity is taken from the file.
+ */
+
+#ifdef GNU_LINUX_EMULATION
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "msc.h"
+
+extern int (*p_msc_scsi_write) (uint32_t lba, const uint8_t *buf, size_t size);
+extern int (*p_msc_scsi_read) (uint32_t lba, const uint8_t **sector_p);
+extern int (*p_msc_scsi_verify) (uint32_t lba);
+extern uint32_t (*p_msc_scsi_capacity) (void);
+extern int (*p_msc_scsi_discard) (uint32_t lba, uint32_t count);
+extern uint8_t msc_scsi_discard_zero;
+extern int (*p_msc_scsi_lookup) (uint32_t lba, const uint8_t **sector_p);
+
+static uint8_t *image;
+static size_t image_size;
+static uint32_t image_sectors;
+static int image_writable;
+
+static int
+file_scsi_write (uint32_t lba, const uint8_t *buf, size_t size)
+{
+  if (lba >= image_sectors || size > MSC_SECTOR_SIZE)
+    return SCSI_ERROR_ILLEAGAL_REQUEST;
+
+  if (!image_writable)
+    return SCSI_ERROR_DATA_PROTECT;
+
+  memcpy (image + (size_t)lba * MSC_SECTOR_SIZE, buf, size);
+  return 0;
+}
+
+static int
+file_scsi_read (uint32_t lba, const uint8_t **sector_p)
+{
+  if (lba >= image_sectors)
+    return SCSI_ERROR_ILLEAGAL_REQUEST;
+
+  *sector_p = image + (size_t)lba * MSC_SECTOR_SIZE;
+  return 0;
+}
+
+static int
+file_scsi_verify (uint32_t lba)
+{
+  if (lba >= image_sectors)
+    return SCSI_ERROR_ILLEAGAL_REQUEST;
+
+  return 0;
+}
+
+/*
+ * Discarded sectors read as zeros.  Whole pages are given back to
+ * the file system (hole), if it supports MADV_REMOVE.
+ */
+static int
+file_scsi_discard (uint32_t lba, uint32_t count)
+{
+  uintptr_t page = sysconf (_SC_PAGESIZE);
+  uint8_t *start, *end, *p, *q;
+
+  if (lba > image_sectors || count > image_sectors - lba)
+    return SCSI_ERROR_ILLEAGAL_REQUEST;
+
+  start = image + (size_t)lba * MSC_SECTOR_SIZE;
+  end = start + (size_t)count * MSC_SECTOR_SIZE;
+  p = (uint8_t *)(((uintptr_t)start + page - 1) & ~(page - 1));
+  q = (uint8_t *)((uintptr_t)end & ~(page - 1));
+
+#ifdef MADV_REMOVE
+  if (p < q && madvise (p, q - p, MADV_REMOVE) == 0)
+    {
+      memset (start, 0, p - start);
+      memset (q, 0, end - q);
+      return 0;
+    }
+#endif
+
+  memset (start, 0, end - start);
+  return 0;
+}
+
+static uint32_t
+file_scsi_capacity (void)
+{
+  return image_sectors;
+}
+
+void
+fraucheky_file_close (void)
+{
+  if (image == NULL)
+    return;
+
+  p_msc_scsi_write = NULL;
+  p_msc_scsi_read = NULL;
+  p_msc_scsi_verify = NULL;
+  p_msc_scsi_capacity = NULL;
+  p_msc_scsi_discard = NULL;
+  p_msc_scsi_lookup = NULL;
+
+  if (image_writable)
+    msync (image, image_size, MS_SYNC);
+  munmap (image, image_size);
+  image = NULL;
+  image_size = 0;
+  image_sectors = 0;
+}
+
+/*
+ * Open FILENAME as the volume.  When WRITABLE is non-zero, it's
+ * opened for reading and writing.  It returns 0 on success, -1 on
+ * error.
+ */
+int
+fraucheky_file_open (const char *filename, int writable)
+{
+  struct stat st;
+  void *p;
+  int fd;
+
+  fd = open (filename, writable ? O_RDWR : O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat (fd, &st) < 0
+      || st.st_size < MSC_SECTOR_SIZE
+      || (st.st_size % MSC_SECTOR_SIZE) != 0
+      || st.st_size / MSC_SECTOR_SIZE > 0xffffffff)
+    {
+      close (fd);
+      return -1;
+    }
+
+  p = mmap (NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0),
+	    MAP_SHARED, fd, 0);
+  close (fd);
+  if (p == MAP_FAILED)
+    return -1;
+
+  fraucheky_file_close ();
+
+  image = p;
+  image_size = st.st_size;
+  image_sectors = st.st_size / MSC_SECTOR_SIZE;
+  image_writable = writable;
+
+  p_msc_scsi_write = file_scsi_write;
+  p_msc_scsi_read = file_scsi_read;
+  p_msc_scsi_verify = file_scsi_verify;
+  p_msc_scsi_capacity = file_scsi_capacity;
+  /* Reading the mapping doesn't block (when it's in page cache).  */
+  p_msc_scsi_lookup = file_scsi_read;
+  if (writable)
+    {
+      p_msc_scsi_discard = file_scsi_discard;
+      msc_scsi_discard_zero = 1;
+    }
+  return 0;
+}
+#endif
@@ -1,5 +1,5 @@
 /*
- * disk-on-rom.c -- FAT storage (GPL, README, and INDEX.HTM) on ROM
+ * disk-on-rom.c -- FAT (or ISO 9660) storage (GPL, README, and INDEX.HTM) on ROM
  *
  * Copyright (C) 2013, 2015, 2016, 2017
  *               Free Software Initiative of Japan
@@ -26,6 +26,7 @@
 #include <string.h>
 #include <chopstx.h>
 
+#include "config.h"
 #include "disk-on-rom.h"
 #include "msc.h"
 #include "sys.h"
@@ -33,21 +34,54 @@
 extern int fraucheky_main_active;
 extern int fraucheky_enabled (void);
 
-extern uint8_t _binary_COPYING_start;
-extern uint8_t _binary_COPYING_end;
-extern uint8_t _binary_README_start;
-extern uint8_t _binary_README_end;
-extern uint8_t _binary_INDEX_start;
-extern uint8_t _binary_INDEX_end;
+#ifdef SECTOR_MAP
+/*
+ * Deduplicated sectors of files.  The first sector is all-zero.
+ */
+extern const uint8_t _binary_SECTORS_start[];
+
+static const uint16_t sector_map[] = { SECTOR_MAP };
+
+#define UNIQUE_SECTOR(i) (&_binary_SECTORS_start[(i) * SECTOR_SIZE])
+#else
+extern const uint8_t _binary_COPYING_start[], _binary_COPYING_end[];
+extern const uint8_t _binary_README_start[], _binary_README_end[];
+extern const uint8_t _binary_INDEX_start[], _binary_INDEX_end[];
+#endif
 
 int (*p_msc_scsi_write) (uint32_t lba, const uint8_t *buf, size_t size);
 int (*p_msc_scsi_read) (uint32_t lba, const uint8_t **sector_p);
+int (*p_msc_scsi_verify) (uint32_t lba);
+uint32_t (*p_msc_scsi_capacity) (void);
+int (*p_msc_scsi_discard) (uint32_t lba, uint32_t count);
 void (*p_msc_scsi_stop) (uint8_t code);
+int (*p_msc_scsi_lookup) (uint32_t lba, const uint8_t **sector_p);
+/* Sectors discarded by p_msc_scsi_discard read as zeros.  */
+uint8_t msc_scsi_discard_zero;
+/*
+ * Encryption of a sector generated here (installed by disk-crypt.c).
+ * With VOLUME_CRYPT, sectors of files are encrypted by configure, and
+ * other sectors are encrypted by this, so that all sectors read as
+ * ciphertext.
+ */
+void (*p_msc_rom_seal) (uint32_t lba, uint8_t *sector);
+
+#if SECTOR_SIZE != MSC_SECTOR_SIZE
+#error "SECTOR_SIZE of configure and MSC_SECTOR_SIZE of config.h differ"
+#endif
 
-#define TOTAL_SECTORS 128	/* Maximum 64KB.  */
-#define SECTOR_SIZE 512
+#if defined(VOLUME_CRYPT) && !defined(SECTOR_MAP)
+#error "VOLUME_CRYPT needs SECTOR_MAP (FRAUCHEKY_DEDUP=yes)"
+#endif
+
+#ifndef VOLUME_ISO9660
+#define ROOTDIR_ENTRIES (SECTOR_SIZE/32)
+#define VOLUME_SECTORS  (TOTAL_SECTORS-PARTITION_START)
 
 /*
+ * Layout is generated by configure.  With 512-byte sector and no
+ * alignment, it is:
+ *
  * blk=0: master boot record sector
  * blk=1: fat0
  * blk=2: fat1
@@ -55,23 +89,30 @@ void (*p_msc_scsi_stop) (uint8_t code);
  * blk=4: fat cluster #2
  * ...
  * blk=4+123: fat cluster #2+123
+ *
+ * When the volume is aligned to erase block, reserved sectors are
+ * added before fat0 so that the data region starts at erase block
+ * boundary, and a cluster consists of sectors of an erase block.
+ * With partition table, blk=0 has the table and the boot sector is
+ * at PARTITION_START.
  */
 
 static const uint8_t d0_0_sector[] = {
   0xeb, 0x3c,             /* Jump instruction */
   0x90,                   /* NOP instruction */
   0x6d, 0x6b, 0x64, 0x6f, 0x73, 0x66, 0x73, 0x00, /* "mkdosfs" */
-  0x00, 0x02,             /* Bytes per sector: 512 */
-  0x01,                   /* sectors per cluster: 1 */
-  0x01, 0x00,             /* reserved sector count: 1 */
+  SECTOR_SIZE & 0xff, SECTOR_SIZE >> 8, /* Bytes per sector */
+  SECTORS_PER_CLUSTER,    /* sectors per cluster */
+  RESERVED_SECTORS & 0xff, RESERVED_SECTORS >> 8, /* reserved sector count */
   0x02,                   /* Number of FATs: 2 */
-  0x10, 0x00,             /* Max. root directory entries: 16 (1 sector) */
-  TOTAL_SECTORS, 0x00,    /* total sectors: 128 */
+  ROOTDIR_ENTRIES & 0xff, ROOTDIR_ENTRIES >> 8, /* Max. root dir entries */
+  VOLUME_SECTORS & 0xff, VOLUME_SECTORS >> 8, /* total sectors */
   0xf8,                   /* media descriptor: fixed disk */
   0x01, 0x00,             /* sectors per FAT: 1 */
   0x20, 0x00,             /* sectors per track: 32 */
   0x40, 0x00,             /* number of heads: 64 */
-  0x00, 0x00, 0x00, 0x00, /* hidden sectors: 0 */
+  PARTITION_START & 0xff, (PARTITION_START >> 8) & 0xff,
+  (PARTITION_START >> 16) & 0xff, PARTITION_START >> 24, /* hidden sectors */
   0x00, 0x00, 0x00, 0x00, /* total sectors (long) */
   0x00,                   /* drive number */
   0x00,                   /* reserved */
@@ -113,16 +154,57 @@ static const uint8_t d0_0_sector[] = {
 };
 
 
-/* Sector no for Root:       3 */
-#define DROPHERE_SECTOR      4
-#define COPYING_SECTOR_START 5
-#define COPYING_SECTOR_END   (COPYING_SECTOR_START+COPYING_BLOCKS-1)
+#if PARTITION_START != 0
+static const uint8_t d0_partition_entry[] = {
+  0x00,                   /* status: not bootable */
+  0xfe, 0xff, 0xff,       /* CHS of first sector: use LBA */
+  0x01,                   /* partition type: FAT12 */
+  0xfe, 0xff, 0xff,       /* CHS of last sector: use LBA */
+  PARTITION_START & 0xff, (PARTITION_START >> 8) & 0xff,
+  (PARTITION_START >> 16) & 0xff, PARTITION_START >> 24, /* LBA of first */
+  VOLUME_SECTORS & 0xff, (VOLUME_SECTORS >> 8) & 0xff,
+  (VOLUME_SECTORS >> 16) & 0xff, VOLUME_SECTORS >> 24, /* number of sectors */
+};
+#endif
+
+#define FAT0_SECTOR          (PARTITION_START+RESERVED_SECTORS)
+#define FAT1_SECTOR          (FAT0_SECTOR+1)
+#define ROOTDIR_SECTOR       (FAT1_SECTOR+1)
+#define DATA_SECTOR          (ROOTDIR_SECTOR+1)
+#define DROPHERE_SECTOR      DATA_SECTOR
+#define COPYING_SECTOR_START (DROPHERE_SECTOR+SECTORS_PER_CLUSTER)
+#else
+/*
+ * ISO 9660 volume for CD-ROM (FRAUCHEKY_CDROM=yes of configure).
+ * Sector size is 2048, and the layout is:
+ *
+ * blk=0..15: system area (zero)
+ * blk=16: primary volume descriptor
+ * blk=17: volume descriptor set terminator
+ * blk=18: path table (little endian)
+ * blk=19: path table (big endian)
+ * blk=20: root directory
+ * blk=21: files, one after another
+ *
+ * Descriptors are made in the_sector by msc_rom_read.  It's read
+ * only, there is no DROPHERE.
+ */
+#define PVD_SECTOR           16
+#define TERMINATOR_SECTOR    17
+#define PATH_TABLE_L_SECTOR  18
+#define PATH_TABLE_M_SECTOR  19
+#define ROOTDIR_SECTOR       20
+#define COPYING_SECTOR_START 21
+#endif
+
+#define COPYING_SECTOR_END   (COPYING_SECTOR_START+COPYING_CLUSTERS*SECTORS_PER_CLUSTER-1)
 #define README_SECTOR_START  (COPYING_SECTOR_END+1)
-#define README_SECTOR_END    (README_SECTOR_START+README_BLOCKS-1)
+#define README_SECTOR_END    (README_SECTOR_START+README_CLUSTERS*SECTORS_PER_CLUSTER-1)
 #define INDEX_SECTOR_START   (README_SECTOR_END+1)
-#define INDEX_SECTOR_END     (INDEX_SECTOR_START+INDEX_BLOCKS-1)
+#define INDEX_SECTOR_END     (INDEX_SECTOR_START+INDEX_CLUSTERS*SECTORS_PER_CLUSTER-1)
 
-#define CLSTR_NO(sec_no) (sec_no-2)
+#ifndef VOLUME_ISO9660
+#define CLSTR_NO(sec_no) (((sec_no)-DATA_SECTOR)/SECTORS_PER_CLUSTER+2)
 
 static const uint8_t d0_fat0_sector[] = {
   0xf8, 0xff, 0xff,  /* Media descriptor: fixed disk *//* EOC */
@@ -144,18 +226,21 @@ static const uint8_t d0_rootdir_sector[] = {
   'C', 'O', 'P',  'Y',  'I',  'N',  'G',  ' ',  ' ',  ' ',  ' ', 
   /* "COPYING     " */
   COPYING_ATTRIBUTES,
-  CLSTR_NO (COPYING_SECTOR_START), 0x00,  /* cluster # */
+  CLSTR_NO (COPYING_SECTOR_START) & 0xff, CLSTR_NO (COPYING_SECTOR_START) >> 8,
+  /* cluster # */
   COPYING_FILE_SIZE,
 
   'R', 'E', 'A',  'D',  'M',  'E',  ' ',  ' ',  ' ',  ' ',  ' ', 
   /* "README      " */
   README_ATTRIBUTES,
-  CLSTR_NO (README_SECTOR_START), 0x00,  /* cluster # */
+  CLSTR_NO (README_SECTOR_START) & 0xff, CLSTR_NO (README_SECTOR_START) >> 8,
+  /* cluster # */
   README_FILE_SIZE,
 
   'I', 'N', 'D', 'E', 'X', ' ', ' ', ' ', 'H', 'T', 'M', /* INDEX.HTM */
   INDEX_ATTRIBUTES,
-  CLSTR_NO (INDEX_SECTOR_START), 0x00, /* cluster # */
+  CLSTR_NO (INDEX_SECTOR_START) & 0xff, CLSTR_NO (INDEX_SECTOR_START) >> 8,
+  /* cluster # */
   INDEX_FILE_SIZE,
 
   'D', 'R', 'O', 'P', 'H', 'E', 'R', 'E', ' ', ' ', ' ', /* DROPHERE */
@@ -165,7 +250,8 @@ static const uint8_t d0_rootdir_sector[] = {
   0x63, 0x43, /* last access */
   0x00, 0x00,
   0xe4, 0x74, 0x16, 0x43, /* last modified */
-  CLSTR_NO (DROPHERE_SECTOR), 0x00,  /* cluster # */
+  CLSTR_NO (DROPHERE_SECTOR) & 0xff, CLSTR_NO (DROPHERE_SECTOR) >> 8,
+  /* cluster # */
   0x00, 0x00, 0x00, 0x00  /* file size */
 };
 
@@ -178,7 +264,8 @@ static const uint8_t d0_drophere_sector[] = {
   0x65, 0x43,  /* last access */
   0x00, 0x00,
   0xe7, 0x63, 0x65, 0x43,  /* last modified */
-  CLSTR_NO (DROPHERE_SECTOR), 0x00, /* cluster # */
+  CLSTR_NO (DROPHERE_SECTOR) & 0xff, CLSTR_NO (DROPHERE_SECTOR) >> 8,
+  /* cluster # */
   0x00, 0x00, 0x00, 0x00, /* file size */
 
   '.', '.', ' ',  ' ',  ' ',  ' ',  ' ',  ' ',  ' ',  ' ',  ' ', 
@@ -192,37 +279,195 @@ static const uint8_t d0_drophere_sector[] = {
   0x00, 0x00, /* cluster # */
   0x00, 0x00, 0x00, 0x00, /* file size */
 };
+#else
+/* Both-byte order, little endian then big endian.  */
+#define ISO_BOTH16(v) \
+  (v) & 0xff, ((v) >> 8) & 0xff, ((v) >> 8) & 0xff, (v) & 0xff
+#define ISO_BOTH32(v) \
+  (v) & 0xff, ((v) >> 8) & 0xff, ((v) >> 16) & 0xff, ((v) >> 24) & 0xff, \
+  ((v) >> 24) & 0xff, ((v) >> 16) & 0xff, ((v) >> 8) & 0xff, (v) & 0xff
+
+static const uint8_t d0_path_table_l[] = {
+  1, 0,                   /* Length of name, extended attribute */
+  ROOTDIR_SECTOR, 0, 0, 0, /* Location of the root directory */
+  1, 0,                   /* Parent directory */
+  0, 0                    /* Name (root), padding */
+};
 
-static uint8_t the_sector[512];
+static const uint8_t d0_path_table_m[] = {
+  1, 0,
+  0, 0, 0, ROOTDIR_SECTOR,
+  0, 1,
+  0, 0
+};
+
+/*
+ * Directory records: length of record, length of extended attribute,
+ * location of extent, data length, recording date and time, flags,
+ * unit size, gap size, volume sequence number, and identifier.  A
+ * record is padded to even length.
+ */
+static const uint8_t d0_rootdir_sector[] = {
+  34, 0,
+  ISO_BOTH32 (ROOTDIR_SECTOR), ISO_BOTH32 (SECTOR_SIZE),
+  ISO_ROOT_DATE,
+  0x02, 0, 0, ISO_BOTH16 (1), /* Directory */
+  1, 0x00,		  /* "." */
+
+  34, 0,
+  ISO_BOTH32 (ROOTDIR_SECTOR), ISO_BOTH32 (SECTOR_SIZE),
+  ISO_ROOT_DATE,
+  0x02, 0, 0, ISO_BOTH16 (1),
+  1, 0x01,		  /* ".." */
+
+  44, 0,
+  ISO_BOTH32 (COPYING_SECTOR_START), ISO_BOTH32 (COPYING_SIZE),
+  COPYING_ISO_DATE,
+  0x00, 0, 0, ISO_BOTH16 (1),
+  10, 'C', 'O', 'P', 'Y', 'I', 'N', 'G', '.', ';', '1', 0,
+
+  42, 0,
+  ISO_BOTH32 (README_SECTOR_START), ISO_BOTH32 (README_SIZE),
+  README_ISO_DATE,
+  0x00, 0, 0, ISO_BOTH16 (1),
+  9, 'R', 'E', 'A', 'D', 'M', 'E', '.', ';', '1',
+
+  44, 0,
+  ISO_BOTH32 (INDEX_SECTOR_START), ISO_BOTH32 (INDEX_SIZE),
+  INDEX_ISO_DATE,
+  0x00, 0, 0, ISO_BOTH16 (1),
+  11, 'I', 'N', 'D', 'E', 'X', '.', 'H', 'T', 'M', ';', '1',
+};
+
+static void
+iso_put_both (uint8_t *p, uint32_t v, int size)
+{
+  int i;
+
+  for (i = 0; i < size; i++)
+    p[i] = p[2 * size - 1 - i] = v >> (8 * i);
+}
+
+/* Primary volume descriptor.  */
+static void
+iso_pvd (uint8_t *p)
+{
+  memset (p, 0, SECTOR_SIZE);
+  p[0] = 1;
+  memcpy (p + 1, "CD001", 5);
+  p[6] = 1;
+  memset (p + 8, ' ', 64);		/* System and volume identifier */
+  memcpy (p + 40, "FRAUCHEKY", 9);
+  iso_put_both (p + 80, TOTAL_SECTORS, 4);
+  iso_put_both (p + 120, 1, 2);		/* Volume set size */
+  iso_put_both (p + 124, 1, 2);		/* Volume sequence number */
+  iso_put_both (p + 128, SECTOR_SIZE, 2);
+  iso_put_both (p + 132, sizeof d0_path_table_l, 4);
+  p[140] = PATH_TABLE_L_SECTOR;
+  p[151] = PATH_TABLE_M_SECTOR;
+  memcpy (p + 156, d0_rootdir_sector, 34); /* Same as "." */
+  memset (p + 190, ' ', 813 - 190);	/* Identifiers */
+  memcpy (p + 702, "COPYING.;1", 10);	/* Copyright file */
+  memcpy (p + 813, ISO_VOLUME_DATE, 17); /* Creation */
+  memcpy (p + 830, ISO_VOLUME_DATE, 17); /* Modification */
+  memset (p + 847, '0', 16);		/* Expiration */
+  memset (p + 864, '0', 16);		/* Effective */
+  p[881] = 1;				/* File structure version */
+}
+#endif
+
+#ifdef MSC_MINIMAL_RAM
+/* The sector buffer is shared with usb-msc.c.  */
+extern uint8_t msc_arena[];
+#define the_sector msc_arena
+#else
+static uint8_t the_sector[SECTOR_SIZE];
+#endif
 
 const uint16_t rom_var = { 0xffff };
 
+/*
+ * The volume on ROM, without hooks.  A hook (e.g. of flash-ftl.c)
+ * can use them for sectors it doesn't have.
+ */
 int
-msc_scsi_write (uint32_t lba, const uint8_t *buf, size_t size)
+msc_rom_write (uint32_t lba, const uint8_t *buf, size_t size)
 {
-  if (p_msc_scsi_write)
-    return (*p_msc_scsi_write) (lba, buf, size);
+  (void)buf;
+  (void)size;
 
+#ifdef VOLUME_ISO9660
+  (void)lba;
+  return SCSI_ERROR_DATA_PROTECT;
+#else
 #if !defined(GNU_LINUX_EMULATION)
-  if (fraucheky_enabled () && lba == DROPHERE_SECTOR)
+  if (fraucheky_enabled () && lba >= DROPHERE_SECTOR
+      && lba < DROPHERE_SECTOR + SECTORS_PER_CLUSTER)
     {
       flash_unlock ();
       flash_program_halfword ((uintptr_t)&rom_var, 0);
     }
+#else
+  (void)lba;
 #endif
 
   return 0;
+#endif
 }
 
 int
-msc_scsi_read (uint32_t lba, const uint8_t **sector_p)
+msc_scsi_write (uint32_t lba, const uint8_t *buf, size_t size)
 {
-  uint32_t offset;
+  if (p_msc_scsi_write)
+    return (*p_msc_scsi_write) (lba, buf, size);
+
+  return msc_rom_write (lba, buf, size);
+}
+
+int
+msc_scsi_discard (uint32_t lba, uint32_t count)
+{
+  if (p_msc_scsi_discard)
+    return (*p_msc_scsi_discard) (lba, count);
+
+  (void)lba;
+  (void)count;
+  return SCSI_ERROR_ILLEAGAL_REQUEST;
+}
+
+uint32_t
+msc_scsi_capacity (void)
+{
+  if (p_msc_scsi_capacity)
+    return (*p_msc_scsi_capacity) ();
+
+  return TOTAL_SECTORS;
+}
+
+#ifndef SECTOR_MAP
+/* Fill the_sector by the data at OFFSET of a file, padding by zero.  */
+static void
+read_file_sector (const uint8_t *start, const uint8_t *end, uint32_t offset)
+{
+  uint32_t len = end - start;
   uint32_t size;
 
-  if (p_msc_scsi_read)
-    return (*p_msc_scsi_read) (lba, sector_p);
+  if (offset >= len)
+    size = 0;
+  else if (len - offset < SECTOR_SIZE)
+    size = len - offset;
+  else
+    size = SECTOR_SIZE;
 
+  memcpy (the_sector, &start[offset], size);
+  if (size != SECTOR_SIZE)
+    memset (the_sector + size, 0, SECTOR_SIZE - size);
+}
+#endif
+
+static int
+rom_sector (uint32_t lba, const uint8_t **sector_p)
+{
   if (lba >= TOTAL_SECTORS)
     return SCSI_ERROR_ILLEAGAL_REQUEST;
 
@@ -230,82 +475,333 @@ msc_scsi_read (uint32_t lba, const uint8_t **sector_p)
 
   switch (lba)
     {
-    case 0:			/* MBR */
+#ifdef VOLUME_ISO9660
+    case PVD_SECTOR:
+      iso_pvd (the_sector);
+      return 0;
+
+    case TERMINATOR_SECTOR:
+      memset (the_sector, 0, SECTOR_SIZE);
+      the_sector[0] = 255;
+      memcpy (the_sector + 1, "CD001", 5);
+      the_sector[6] = 1;
+      return 0;
+
+    case PATH_TABLE_L_SECTOR:
+    case PATH_TABLE_M_SECTOR:
+      memset (the_sector, 0, SECTOR_SIZE);
+      if (lba == PATH_TABLE_L_SECTOR)
+	memcpy (the_sector, d0_path_table_l, sizeof d0_path_table_l);
+      else
+	memcpy (the_sector, d0_path_table_m, sizeof d0_path_table_m);
+      return 0;
+#else
+#if PARTITION_START != 0
+    case 0:			/* Partition table.  */
+      memset (the_sector, 0, SECTOR_SIZE);
+      memcpy (the_sector + 446, d0_partition_entry, sizeof d0_partition_entry);
+      the_sector[510] = 0x55;
+      the_sector[511] = 0xaa;
+      return 0;
+#endif
+
+    case PARTITION_START:	/* MBR */
       memcpy (the_sector, d0_0_sector, sizeof d0_0_sector);
-      memset (the_sector + sizeof d0_0_sector, 0, 512 - sizeof d0_0_sector);
+      memset (the_sector + sizeof d0_0_sector, 0,
+	      SECTOR_SIZE - sizeof d0_0_sector);
+      /* Signature is at 510, regardless of the sector size.  */
       the_sector[510] = 0x55;
       the_sector[511] = 0xaa;
       return 0;
 
-    case 1:
-    case 2:			/* FAT */
+    case FAT0_SECTOR:
+    case FAT1_SECTOR:		/* FAT */
       memcpy (the_sector, d0_fat0_sector, sizeof d0_fat0_sector);
       memset (the_sector + sizeof d0_fat0_sector, 0,
-	      512 - sizeof d0_fat0_sector);
+	      SECTOR_SIZE - sizeof d0_fat0_sector);
       return 0;
+#endif
 
-    case 3:			/* Root directory.  */
+    case ROOTDIR_SECTOR:	/* Root directory.  */
       memcpy (the_sector, d0_rootdir_sector, sizeof d0_rootdir_sector);
       memset (the_sector + sizeof d0_rootdir_sector, 0,
-	      512 - sizeof d0_rootdir_sector);
+	      SECTOR_SIZE - sizeof d0_rootdir_sector);
       return 0;
 
-    case 4:			/* DROPHERE directory.  */
+#ifndef VOLUME_ISO9660
+    case DROPHERE_SECTOR:	/* DROPHERE directory.  */
       memcpy (the_sector, d0_drophere_sector, sizeof d0_drophere_sector);
       memset (the_sector + sizeof d0_drophere_sector, 0,
-	      512 - sizeof d0_drophere_sector);
+	      SECTOR_SIZE - sizeof d0_drophere_sector);
       return 0;
+#endif
 
     default:
+#ifdef SECTOR_MAP
+      /* Files and unused sectors are served from ROM directly.  */
+      if (lba >= COPYING_SECTOR_START && lba <= INDEX_SECTOR_END)
+	*sector_p = UNIQUE_SECTOR (sector_map[lba - COPYING_SECTOR_START]);
+      else
+	*sector_p = UNIQUE_SECTOR (0);
+#else
       if (lba >= COPYING_SECTOR_START && lba <= COPYING_SECTOR_END)
-	{
-	  offset = (lba - COPYING_SECTOR_START) * SECTOR_SIZE;
-	  size = SECTOR_SIZE;
-
-	  if (lba == COPYING_SECTOR_END)
-	    {
-	      size = &_binary_COPYING_end - &_binary_COPYING_start
-		- (COPYING_BLOCKS - 1) * SECTOR_SIZE;
-	      if (size != SECTOR_SIZE)
-		memset (the_sector + size, 0, SECTOR_SIZE - size);
-	    }
-
-	  memcpy (the_sector, &_binary_COPYING_start + offset, size);
-	}
+	read_file_sector (_binary_COPYING_start, _binary_COPYING_end,
+			  (lba - COPYING_SECTOR_START) * SECTOR_SIZE);
       else if (lba >= README_SECTOR_START && lba <= README_SECTOR_END)
-	{
-	  offset = (lba - README_SECTOR_START) * SECTOR_SIZE;
-	  size = SECTOR_SIZE;
-
-	  if (lba == README_SECTOR_END)
-	    {
-	      size = &_binary_README_end - &_binary_README_start
-		- (README_BLOCKS - 1) * SECTOR_SIZE;
-	      if (size != SECTOR_SIZE)
-		memset (the_sector + size, 0, SECTOR_SIZE - size);
-	    }
-
-	  memcpy (the_sector, &_binary_README_start + offset, size);
-	}
+	read_file_sector (_binary_README_start, _binary_README_end,
+			  (lba - README_SECTOR_START) * SECTOR_SIZE);
       else if (lba >= INDEX_SECTOR_START && lba <= INDEX_SECTOR_END)
+	read_file_sector (_binary_INDEX_start, _binary_INDEX_end,
+			  (lba - INDEX_SECTOR_START) * SECTOR_SIZE);
+      else
+	memset (the_sector, 0, SECTOR_SIZE);
+#endif
+      return 0;
+    }
+}
+
+int
+msc_rom_read (uint32_t lba, const uint8_t **sector_p)
+{
+  int r = rom_sector (lba, sector_p);
+
+#ifdef VOLUME_CRYPT
+  if (r == 0 && p_msc_rom_seal
+      && (lba < COPYING_SECTOR_START || lba > INDEX_SECTOR_END))
+    {
+      if (*sector_p != the_sector)
 	{
-	  offset = (lba - INDEX_SECTOR_START) * SECTOR_SIZE;
-	  size = SECTOR_SIZE;
-
-	  if (lba == INDEX_SECTOR_END)
-	    {
-	      size = &_binary_INDEX_end - &_binary_INDEX_start
-		- (INDEX_BLOCKS - 1) * SECTOR_SIZE;
-	      if (size != SECTOR_SIZE)
-		memset (the_sector + size, 0, SECTOR_SIZE - size);
-	    }
-
-	  memcpy (the_sector, &_binary_INDEX_start + offset, size);
+	  memcpy (the_sector, *sector_p, SECTOR_SIZE);
+	  *sector_p = the_sector;
 	}
+      (*p_msc_rom_seal) (lba, the_sector);
+    }
+#endif
+  return r;
+}
+
+int
+msc_scsi_read (uint32_t lba, const uint8_t **sector_p)
+{
+  if (p_msc_scsi_read)
+    return (*p_msc_scsi_read) (lba, sector_p);
+
+  return msc_rom_read (lba, sector_p);
+}
+
+#ifndef SECTOR_MAP
+static int
+lookup_file_sector (const uint8_t *start, const uint8_t *end, uint32_t offset,
+		    const uint8_t **sector_p)
+{
+  if ((uint32_t)(end - start) < offset + SECTOR_SIZE)
+    /* The last sector is padded in the_sector.  */
+    return -1;
+
+  *sector_p = &start[offset];
+  return 0;
+}
+#endif
+
+/*
+ * Sectors on ROM as they are, without the_sector.  It doesn't block,
+ * so, usb-msc.c calls it in the USB callback while the_sector may be
+ * sent.  It returns -1 for other sectors.
+ */
+int
+msc_rom_lookup (uint32_t lba, const uint8_t **sector_p)
+{
+  if (lba >= TOTAL_SECTORS)
+    return -1;
+
+  switch (lba)
+    {
+#ifdef VOLUME_ISO9660
+    case PVD_SECTOR:
+    case TERMINATOR_SECTOR:
+    case PATH_TABLE_L_SECTOR:
+    case PATH_TABLE_M_SECTOR:
+    case ROOTDIR_SECTOR:
+#else
+#if PARTITION_START != 0
+    case 0:
+#endif
+    case PARTITION_START:
+    case FAT0_SECTOR:
+    case FAT1_SECTOR:
+    case ROOTDIR_SECTOR:
+    case DROPHERE_SECTOR:
+#endif
+      return -1;
+
+    default:
+#ifdef SECTOR_MAP
+      if (lba >= COPYING_SECTOR_START && lba <= INDEX_SECTOR_END)
+	*sector_p = UNIQUE_SECTOR (sector_map[lba - COPYING_SECTOR_START]);
       else
-	memset (the_sector, 0, 512);
+#ifdef VOLUME_CRYPT
+	/* It's encrypted into the_sector.  */
+	return -1;
+#else
+	*sector_p = UNIQUE_SECTOR (0);
+#endif
       return 0;
+#else
+      if (lba >= COPYING_SECTOR_START && lba <= COPYING_SECTOR_END)
+	return lookup_file_sector (_binary_COPYING_start, _binary_COPYING_end,
+				   (lba - COPYING_SECTOR_START) * SECTOR_SIZE,
+				   sector_p);
+      else if (lba >= README_SECTOR_START && lba <= README_SECTOR_END)
+	return lookup_file_sector (_binary_README_start, _binary_README_end,
+				   (lba - README_SECTOR_START) * SECTOR_SIZE,
+				   sector_p);
+      else if (lba >= INDEX_SECTOR_START && lba <= INDEX_SECTOR_END)
+	return lookup_file_sector (_binary_INDEX_start, _binary_INDEX_end,
+				   (lba - INDEX_SECTOR_START) * SECTOR_SIZE,
+				   sector_p);
+      else
+	return -1;
+#endif
+    }
+}
+
+int
+msc_scsi_lookup (uint32_t lba, const uint8_t **sector_p)
+{
+  if (p_msc_scsi_lookup)
+    return (*p_msc_scsi_lookup) (lba, sector_p);
+
+  if (p_msc_scsi_read)
+    /* Sectors by the hook are unknown here.  */
+    return -1;
+
+  return msc_rom_lookup (lba, sector_p);
+}
+
+/*
+ * CRC-32 (IEEE 802.3), by the table of nibbles: two lookups for each
+ * byte, with the table of only 64 bytes.
+ */
+static const uint32_t crc32_nibble[16] = {
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+  0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+  0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+/* Update CRC by N bytes at P.  When P is NULL, by N zero bytes.  */
+static uint32_t
+crc32_update (uint32_t crc, const uint8_t *p, size_t n)
+{
+  while (n--)
+    {
+      if (p)
+	crc ^= *p++;
+      crc = (crc >> 4) ^ crc32_nibble[crc & 0x0f];
+      crc = (crc >> 4) ^ crc32_nibble[crc & 0x0f];
     }
+
+  return crc;
+}
+
+uint32_t
+msc_crc32 (const uint8_t *p, size_t n)
+{
+  return ~crc32_update (0xffffffff, p, n);
+}
+
+#ifdef SECTOR_CRC
+static const uint32_t sector_crc[] = { SECTOR_CRC };
+
+#ifndef SECTOR_MAP
+/* CRC-32 of the sector at OFFSET of a file, padded by zero.  */
+static uint32_t
+file_sector_crc (const uint8_t *start, const uint8_t *end, uint32_t offset)
+{
+  uint32_t len = end - start;
+  uint32_t size, crc;
+
+  if (offset >= len)
+    size = 0;
+  else if (len - offset < SECTOR_SIZE)
+    size = len - offset;
+  else
+    size = SECTOR_SIZE;
+
+  crc = crc32_update (0xffffffff, &start[offset], size);
+  return ~crc32_update (crc, NULL, SECTOR_SIZE - size);
+}
+#endif
+#endif
+
+/*
+ * Check the sector at LBA.  Sectors of files are checked against
+ * SECTOR_CRC computed by configure, directly on ROM, not using
+ * the_sector; It can be called by other threads.
+ */
+int
+msc_scsi_verify (uint32_t lba)
+{
+#ifdef SECTOR_CRC
+  uint32_t crc;
+#endif
+
+  if (p_msc_scsi_verify)
+    return (*p_msc_scsi_verify) (lba);
+
+  if (lba >= TOTAL_SECTORS)
+    return SCSI_ERROR_ILLEAGAL_REQUEST;
+
+#ifdef SECTOR_CRC
+  /* Medium by p_msc_scsi_read is unknown here.  */
+  if (p_msc_scsi_read || lba < COPYING_SECTOR_START || lba > INDEX_SECTOR_END)
+    return 0;
+
+#ifdef SECTOR_MAP
+  crc = msc_crc32 (UNIQUE_SECTOR (sector_map[lba - COPYING_SECTOR_START]),
+		   SECTOR_SIZE);
+#else
+  if (lba <= COPYING_SECTOR_END)
+    crc = file_sector_crc (_binary_COPYING_start, _binary_COPYING_end,
+			   (lba - COPYING_SECTOR_START) * SECTOR_SIZE);
+  else if (lba <= README_SECTOR_END)
+    crc = file_sector_crc (_binary_README_start, _binary_README_end,
+			   (lba - README_SECTOR_START) * SECTOR_SIZE);
+  else
+    crc = file_sector_crc (_binary_INDEX_start, _binary_INDEX_end,
+			   (lba - INDEX_SECTOR_START) * SECTOR_SIZE);
+#endif
+
+  if (crc != sector_crc[lba - COPYING_SECTOR_START])
+    return SCSI_ERROR_MEDIUM_ERROR;
+#endif
+
+  return 0;
+}
+
+/*
+ * Check COUNT sectors from LBA (up to the end of the volume).  It
+ * returns the number of bad sectors, and the first bad one is stored
+ * at *LBA_P.
+ */
+uint32_t
+msc_self_test (uint32_t lba, uint32_t count, uint32_t *lba_p)
+{
+  uint32_t end, bad = 0;
+
+  end = msc_scsi_capacity ();
+  if (lba < end && count < end - lba)
+    end = lba + count;
+
+  *lba_p = 0xffffffff;
+  for (; lba < end; lba++)
+    if (msc_scsi_verify (lba))
+      {
+	if (bad++ == 0)
+	  *lba_p = lba;
+      }
+
+  return bad;
 }
 
 void
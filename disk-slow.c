@@ -0,0 +1,162 @@
+/*
+ * disk-slow.c -- Simulated slow storage, for GNU/Linux emulation
+ *
+ * Copyright (C) 2026 Free Software Initiative of Japan
+ *
+ * This file is a part of Fraucheky, GNU GPL in a USB thumb drive
+ *
+ * Fraucheky is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Fraucheky is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The backend of msc_scsi_read is wrapped to take USEC microseconds
+ * for each sector, like storage on an external chip.  It's to see
+ * the effect of asynchronous requests (MSC_ASYNC_WINDOW).
+ *
+ * With the synchronous medium, the MSC thread waits for the delay.
+ * With the asynchronous medium, a thread of the backend serves
+ * requests in order and waits for the delay instead, so, it overlaps
+ * with sending the previous sector.
+ *
+ * The application switches the medium by:
+ *
+ *     msc_media_swap (fraucheky_slow_medium (usec, async));
+ */
+
+#ifdef GNU_LINUX_EMULATION
+#include <stdint.h>
+#include <string.h>
+#include <chopstx.h>
+
+#include "config.h"
+#include "msc.h"
+
+extern int msc_scsi_write (uint32_t lba, const uint8_t *buf, size_t size);
+extern int msc_scsi_read (uint32_t lba, const uint8_t **sector_p);
+extern int msc_scsi_verify (uint32_t lba);
+extern uint32_t msc_scsi_capacity (void);
+
+#ifndef PRIO_DISK_SLOW
+#define PRIO_DISK_SLOW 2
+#endif
+
+#ifndef DISK_SLOW_STACK_SIZE
+#define DISK_SLOW_STACK_SIZE 8192
+#endif
+
+static uint32_t slow_usec;
+
+static chopstx_mutex_t slow_mutex;
+static chopstx_cond_t slow_cond;
+static struct msc_request *slow_head;
+static struct msc_request *slow_tail;
+static chopstx_t slow_thd;
+static uint8_t slow_stack[DISK_SLOW_STACK_SIZE];
+
+/*
+ * Sectors are copied, since the sector buffer of the backend is
+ * reused by next read.  A buffer is used again after MSC_ASYNC_WINDOW
+ * requests, at that time, usb-msc.c has finished with it.
+ */
+static uint8_t slow_buf[MSC_ASYNC_WINDOW][MSC_SECTOR_SIZE];
+static unsigned int slow_buf_index;
+
+static struct msc_medium slow_medium;
+
+static int
+slow_scsi_read (uint32_t lba, const uint8_t **sector_p)
+{
+  chopstx_usec_wait (slow_usec);
+  return msc_scsi_read (lba, sector_p);
+}
+
+static int
+slow_submit (struct msc_request *req)
+{
+  chopstx_mutex_lock (&slow_mutex);
+  req->next = NULL;
+  if (slow_tail)
+    slow_tail->next = req;
+  else
+    slow_head = req;
+  slow_tail = req;
+  chopstx_cond_signal (&slow_cond);
+  chopstx_mutex_unlock (&slow_mutex);
+  return 0;
+}
+
+static void *
+slow_main (void *arg)
+{
+  struct msc_request *req;
+  const uint8_t *p;
+
+  (void)arg;
+
+  while (1)
+    {
+      chopstx_mutex_lock (&slow_mutex);
+      while (slow_head == NULL)
+	chopstx_cond_wait (&slow_cond, &slow_mutex);
+      req = slow_head;
+      slow_head = req->next;
+      if (slow_head == NULL)
+	slow_tail = NULL;
+      chopstx_mutex_unlock (&slow_mutex);
+
+      chopstx_usec_wait (slow_usec);
+      req->status = msc_scsi_read (req->lba, &p);
+      if (req->status == 0)
+	{
+	  memcpy (slow_buf[slow_buf_index], p, MSC_SECTOR_SIZE);
+	  req->sector = slow_buf[slow_buf_index];
+	  slow_buf_index = (slow_buf_index + 1) % MSC_ASYNC_WINDOW;
+	}
+
+      (*req->complete) (req);
+    }
+
+  return NULL;
+}
+
+/*
+ * Return the medium of the backend with delay of USEC for each
+ * sector.  When ASYNC is non-zero, it's served by requests.
+ */
+const struct msc_medium *
+fraucheky_slow_medium (uint32_t usec, int async)
+{
+  slow_usec = usec;
+
+  slow_medium.nblocks = msc_scsi_capacity ();
+  slow_medium.read = slow_scsi_read;
+  slow_medium.write = msc_scsi_write;
+  slow_medium.verify = msc_scsi_verify;
+  slow_medium.discard = NULL;
+  slow_medium.submit = async ? slow_submit : NULL;
+  slow_medium.lookup = NULL;
+  slow_medium.discard_zero = 0;
+
+  if (async && !slow_thd)
+    {
+      chopstx_mutex_init (&slow_mutex);
+      chopstx_cond_init (&slow_cond);
+      slow_thd = chopstx_create (PRIO_DISK_SLOW, (uintptr_t)slow_stack,
+				 sizeof slow_stack, slow_main, NULL);
+    }
+
+  return &slow_medium;
+}
+#endif
@@ -0,0 +1,499 @@
+/*
+ * flash-ftl.c -- Writable volume by a log on flash ROM
+ *
+ * Copyright (C) 2026 Free Software Initiative of Japan
+ *
+ * This file is a part of Fraucheky, GNU GPL in a USB thumb drive
+ *
+ * Fraucheky is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License,
+ * or (at your option) any later version.
+ *
+ * Fraucheky is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * With FRAUCHEKY_FTL, sectors written by the host are kept in a
+ * region of flash ROM, and read instead of the volume on ROM.  The
+ * first sectors of the volume (up to FRAUCHEKY_FTL_LBAS_MAX, and what
+ * the region can hold) are writable.  Writes to other sectors go to
+ * the volume on ROM (i.e., only DROPHERE is detected).
+ *
+ * The region is FTL_PAGES pages of FRAUCHEKY_FTL_PAGE_SIZE, which
+ * is the unit of erase.  A page has a header, tags of slots, and
+ * slots of sectors at its end:
+ *
+ *   halfword 0: magic        (written after erase, with erase count)
+ *   halfword 1: erase count
+ *   halfword 2,3: sequence number (written when it's used)
+ *   halfword 4: 0 when the sequence number is valid
+ *   tag of slot i at 16+4*i: LBA, low halfword then high halfword
+ *
+ * Sectors are written in order, as a log.  The data of a slot is
+ * written first, then its tag; the high halfword of the tag commits
+ * the sector.  So, a sector written partially at power loss is just
+ * ignored.  The map from LBA to slot is in RAM, and it is built at
+ * fraucheky_ftl_init by scanning tags of pages in order of sequence
+ * number.  Later one overrides earlier.
+ *
+ * When no page is free, the garbage collection moves live sectors of
+ * a page with fewest live sectors, and erases it.  A page is always
+ * kept free for that.  For wear leveling, a new page is the free page
+ * with least erase count, and, when the difference of erase counts
+ * grows more than FRAUCHEKY_FTL_WEAR_DELTA, the page with least erase
+ * count (which holds cold data) is moved and erased.
+ *
+ * A discarded sector is removed from the map, so that its slot is
+ * not moved by the garbage collection.  It reads as the volume on ROM
+ * again (not as zeros).  It's not recorded on flash ROM; after
+ * fraucheky_ftl_init, it may read as the data discarded, until the
+ * page is erased.
+ */
+
+#ifdef FRAUCHEKY_FTL
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+#include "msc.h"
+#include "sys.h"
+
+extern int (*p_msc_scsi_write) (uint32_t lba, const uint8_t *buf, size_t size);
+extern int (*p_msc_scsi_read) (uint32_t lba, const uint8_t **sector_p);
+extern int msc_rom_write (uint32_t lba, const uint8_t *buf, size_t size);
+extern int msc_rom_read (uint32_t lba, const uint8_t **sector_p);
+extern int (*p_msc_scsi_lookup) (uint32_t lba, const uint8_t **sector_p);
+extern int msc_rom_lookup (uint32_t lba, const uint8_t **sector_p);
+extern int (*p_msc_scsi_discard) (uint32_t lba, uint32_t count);
+extern uint8_t msc_scsi_discard_zero;
+
+#ifndef FRAUCHEKY_FTL_PAGE_SIZE
+#define FRAUCHEKY_FTL_PAGE_SIZE 1024
+#endif
+
+#ifndef FRAUCHEKY_FTL_PAGES_MAX
+#define FRAUCHEKY_FTL_PAGES_MAX 64
+#endif
+
+#ifndef FRAUCHEKY_FTL_LBAS_MAX
+#define FRAUCHEKY_FTL_LBAS_MAX 256
+#endif
+
+#ifndef FRAUCHEKY_FTL_WEAR_DELTA
+#define FRAUCHEKY_FTL_WEAR_DELTA 16
+#endif
+
+#define FTL_MAGIC    0x4c46	/* "FL" */
+#define FTL_HEADER   16
+#define FTL_SLOTS    ((FRAUCHEKY_FTL_PAGE_SIZE - FTL_HEADER) \
+		      / (MSC_SECTOR_SIZE + 4))
+#define FTL_UNMAPPED 0xffff
+#define FTL_FREE     0xffffffff
+
+#if FTL_SLOTS == 0
+#error "FRAUCHEKY_FTL_PAGE_SIZE is too small for MSC_SECTOR_SIZE"
+#endif
+
+static uint8_t *ftl_base;
+static unsigned int ftl_pages;
+static uint32_t ftl_lbas;
+
+static uint16_t ftl_map[FRAUCHEKY_FTL_LBAS_MAX];
+static uint32_t ftl_page_seq[FRAUCHEKY_FTL_PAGES_MAX];
+static uint16_t ftl_erase[FRAUCHEKY_FTL_PAGES_MAX];
+static uint8_t ftl_live[FRAUCHEKY_FTL_PAGES_MAX];
+
+static uint32_t ftl_seq;	/* Sequence number for next page.  */
+static int ftl_active;		/* Page to be written, or -1.  */
+static unsigned int ftl_used;	/* Slots used in the active page.  */
+static unsigned int ftl_free;	/* Number of free pages.  */
+
+static uint8_t *
+ftl_page (unsigned int page)
+{
+  return ftl_base + page * FRAUCHEKY_FTL_PAGE_SIZE;
+}
+
+static uint16_t *
+ftl_header (unsigned int page)
+{
+  return (uint16_t *)ftl_page (page);
+}
+
+static uint16_t *
+ftl_tag (unsigned int page, unsigned int slot)
+{
+  return (uint16_t *)(ftl_page (page) + FTL_HEADER + 4 * slot);
+}
+
+static uint8_t *
+ftl_data (unsigned int page, unsigned int slot)
+{
+  return ftl_page (page) + FRAUCHEKY_FTL_PAGE_SIZE
+    - (FTL_SLOTS - slot) * MSC_SECTOR_SIZE;
+}
+
+/* Erase PAGE and write the header with the erase count.  */
+static int
+ftl_format (unsigned int page, uint16_t erase_count)
+{
+  ftl_page_seq[page] = FTL_FREE;
+  ftl_live[page] = 0;
+  ftl_erase[page] = erase_count;
+
+  if (!flash_check_blank (ftl_page (page), FRAUCHEKY_FTL_PAGE_SIZE)
+      && flash_erase_page ((uintptr_t)ftl_page (page)) != 0)
+    return -1;
+
+  if (flash_program_halfword ((uintptr_t)&ftl_header (page)[1], erase_count)
+      || flash_program_halfword ((uintptr_t)&ftl_header (page)[0], FTL_MAGIC))
+    return -1;
+
+  ftl_free++;
+  return 0;
+}
+
+/* Use a free page with least erase count as the active page.  */
+static int
+ftl_activate (void)
+{
+  uint16_t *h;
+  unsigned int p;
+  int page = -1;
+
+  for (p = 0; p < ftl_pages; p++)
+    if (ftl_page_seq[p] == FTL_FREE
+	&& (page < 0 || ftl_erase[p] < ftl_erase[page]))
+      page = p;
+
+  if (page < 0)
+    return -1;
+
+  h = ftl_header (page);
+  if (flash_program_halfword ((uintptr_t)&h[2], ftl_seq & 0xffff)
+      || flash_program_halfword ((uintptr_t)&h[3], ftl_seq >> 16)
+      || flash_program_halfword ((uintptr_t)&h[4], 0))
+    return -1;
+
+  ftl_page_seq[page] = ftl_seq++;
+  ftl_free--;
+  ftl_active = page;
+  ftl_used = 0;
+  return 0;
+}
+
+static void
+ftl_map_set (uint32_t lba, unsigned int page, unsigned int slot)
+{
+  if (ftl_map[lba] != FTL_UNMAPPED)
+    ftl_live[ftl_map[lba] / FTL_SLOTS]--;
+  ftl_map[lba] = page * FTL_SLOTS + slot;
+  ftl_live[page]++;
+}
+
+/* Append a sector to the active page.  */
+static int
+ftl_append (uint32_t lba, const uint8_t *buf)
+{
+  unsigned int slot = ftl_used++;
+  uint16_t *tag = ftl_tag (ftl_active, slot);
+
+  if (!flash_write ((uintptr_t)ftl_data (ftl_active, slot), buf,
+		    MSC_SECTOR_SIZE)
+      || flash_program_halfword ((uintptr_t)&tag[0], lba & 0xffff)
+      || flash_program_halfword ((uintptr_t)&tag[1], lba >> 16))
+    return -1;
+
+  ftl_map_set (lba, ftl_active, slot);
+  return 0;
+}
+
+/*
+ * Select a page to be erased: the page with least erase count when
+ * it's much less than others, or the page with fewest live sectors.
+ */
+static int
+ftl_victim (void)
+{
+  unsigned int p;
+  int victim = -1, coldest = -1;
+  uint16_t erase_max = 0;
+
+  for (p = 0; p < ftl_pages; p++)
+    {
+      if (ftl_erase[p] > erase_max)
+	erase_max = ftl_erase[p];
+
+      if (ftl_page_seq[p] == FTL_FREE || (int)p == ftl_active)
+	continue;
+
+      if (coldest < 0 || ftl_erase[p] < ftl_erase[coldest])
+	coldest = p;
+      if (victim < 0 || ftl_live[p] < ftl_live[victim]
+	  || (ftl_live[p] == ftl_live[victim]
+	      && ftl_erase[p] < ftl_erase[victim]))
+	victim = p;
+    }
+
+  if (coldest >= 0
+      && erase_max - ftl_erase[coldest] > FRAUCHEKY_FTL_WEAR_DELTA
+      && ftl_live[coldest] < FTL_SLOTS)
+    return coldest;
+
+  if (victim >= 0 && ftl_live[victim] == FTL_SLOTS)
+    /* All pages are full of live sectors.  */
+    return -1;
+
+  return victim;
+}
+
+/* Move live sectors of a victim to a new active page, and erase it.  */
+static int
+ftl_collect (void)
+{
+  int victim = ftl_victim ();
+  unsigned int slot;
+  uint32_t lba;
+  uint16_t *tag;
+
+  if (victim < 0 || ftl_activate () < 0)
+    return -1;
+
+  for (slot = 0; slot < FTL_SLOTS && ftl_live[victim]; slot++)
+    {
+      tag = ftl_tag (victim, slot);
+      lba = tag[0] | (tag[1] << 16);
+      if (tag[1] == 0xffff || lba >= ftl_lbas
+	  || ftl_map[lba] != victim * FTL_SLOTS + slot)
+	continue;
+
+      if (ftl_append (lba, ftl_data (victim, slot)) < 0)
+	return -1;
+    }
+
+  return ftl_format (victim, ftl_erase[victim] + 1);
+}
+
+/* Make a slot available in the active page.  */
+static int
+ftl_prepare (void)
+{
+  while (ftl_active < 0 || ftl_used == FTL_SLOTS)
+    {
+      /* Last free page is for the garbage collection.  */
+      if (ftl_free > 1)
+	{
+	  if (ftl_activate () < 0)
+	    return -1;
+	}
+      else if (ftl_collect () < 0)
+	return -1;
+    }
+
+  return 0;
+}
+
+static int
+ftl_read (uint32_t lba, const uint8_t **sector_p)
+{
+  uint16_t loc;
+
+  if (lba < ftl_lbas && (loc = ftl_map[lba]) != FTL_UNMAPPED)
+    {
+      *sector_p = ftl_data (loc / FTL_SLOTS, loc % FTL_SLOTS);
+      return 0;
+    }
+
+  return msc_rom_read (lba, sector_p);
+}
+
+/* Sectors are written only by the MSC thread, so, they are constant
+   while the USB callback sends them.  */
+static int
+ftl_lookup (uint32_t lba, const uint8_t **sector_p)
+{
+  uint16_t loc;
+
+  if (lba < ftl_lbas && (loc = ftl_map[lba]) != FTL_UNMAPPED)
+    {
+      *sector_p = ftl_data (loc / FTL_SLOTS, loc % FTL_SLOTS);
+      return 0;
+    }
+
+  return msc_rom_lookup (lba, sector_p);
+}
+
+static int
+ftl_write (uint32_t lba, const uint8_t *buf, size_t size)
+{
+  const uint8_t *p;
+
+  if (lba >= ftl_lbas || size != MSC_SECTOR_SIZE)
+    return msc_rom_write (lba, buf, size);
+
+  /*
+   * Host often writes the same data again (e.g. FAT).  It's compared
+   * by ftl_lookup, not to use the_sector, which may be BUF itself
+   * (with MSC_MINIMAL_RAM).
+   */
+  if (ftl_lookup (lba, &p) == 0 && !memcmp (p, buf, MSC_SECTOR_SIZE))
+    return msc_rom_write (lba, buf, size);
+
+  flash_unlock ();
+  if (ftl_prepare () < 0 || ftl_append (lba, buf) < 0)
+    return SCSI_ERROR_MEDIUM_ERROR;
+
+  return msc_rom_write (lba, buf, size);
+}
+
+static int
+ftl_discard (uint32_t lba, uint32_t count)
+{
+  uint16_t loc;
+
+  for (; count && lba < ftl_lbas; lba++, count--)
+    if ((loc = ftl_map[lba]) != FTL_UNMAPPED)
+      {
+	ftl_live[loc / FTL_SLOTS]--;
+	ftl_map[lba] = FTL_UNMAPPED;
+      }
+
+  return 0;
+}
+
+/* Build the map by the tags of PAGE.  */
+static void
+ftl_scan (unsigned int page)
+{
+  unsigned int slot;
+  uint32_t lba;
+  uint16_t *tag;
+
+  ftl_used = FTL_SLOTS;
+  for (slot = 0; slot < FTL_SLOTS; slot++)
+    {
+      tag = ftl_tag (page, slot);
+      if (tag[1] != 0xffff)
+	{
+	  lba = tag[0] | (tag[1] << 16);
+	  if (lba < ftl_lbas)
+	    ftl_map_set (lba, page, slot);
+	}
+      else if (tag[0] == 0xffff
+	       && flash_check_blank (ftl_data (page, slot), MSC_SECTOR_SIZE))
+	{
+	  /* Not used yet.  Partially written one is skipped.  */
+	  ftl_used = slot;
+	  break;
+	}
+    }
+}
+
+/*
+ * Use PAGES pages of flash ROM at ADDR, and install the hooks.  It
+ * returns the number of writable sectors, or -1 on error.
+ */
+int
+fraucheky_ftl_init (uintptr_t addr, unsigned int pages)
+{
+  unsigned int p, n;
+  uint16_t *h;
+  int page;
+
+  if (pages < 2 || pages > FRAUCHEKY_FTL_PAGES_MAX)
+    return -1;
+
+  ftl_base = (uint8_t *)addr;
+  ftl_pages = pages;
+  ftl_lbas = (pages - 2) * FTL_SLOTS;
+  if (ftl_lbas > FRAUCHEKY_FTL_LBAS_MAX)
+    ftl_lbas = FRAUCHEKY_FTL_LBAS_MAX;
+  memset (ftl_map, 0xff, sizeof ftl_map);
+  ftl_seq = 0;
+  ftl_active = -1;
+  ftl_free = 0;
+
+  flash_unlock ();
+  for (p = 0; p < pages; p++)
+    {
+      h = ftl_header (p);
+      ftl_live[p] = 0;
+      ftl_erase[p] = h[1];
+      if (h[0] != FTL_MAGIC)
+	{
+	  /* New or broken (by power loss at erase).  */
+	  if (ftl_format (p, h[1] == 0xffff ? 0 : h[1] + 1) < 0)
+	    return -1;
+	}
+      else if (h[4] != 0)
+	{
+	  ftl_page_seq[p] = FTL_FREE;
+	  if (h[2] != 0xffff || h[3] != 0xffff)
+	    {
+	      /* Power loss at activation.  */
+	      if (ftl_format (p, ftl_erase[p] + 1) < 0)
+		return -1;
+	    }
+	  else
+	    ftl_free++;
+	}
+      else
+	{
+	  ftl_page_seq[p] = h[2] | (h[3] << 16);
+	  if (ftl_page_seq[p] >= ftl_seq)
+	    ftl_seq = ftl_page_seq[p] + 1;
+	}
+    }
+
+  /* Replay pages in order.  The last one is the active page.  */
+  for (n = 0; ; n++)
+    {
+      page = -1;
+      for (p = 0; p < pages; p++)
+	if (ftl_page_seq[p] != FTL_FREE
+	    && (n == 0 || ftl_page_seq[p] > ftl_page_seq[ftl_active])
+	    && (page < 0 || ftl_page_seq[p] < ftl_page_seq[page]))
+	  page = p;
+
+      if (page < 0)
+	break;
+
+      ftl_scan (page);
+      ftl_active = page;
+    }
+
+  p_msc_scsi_read = ftl_read;
+  p_msc_scsi_write = ftl_write;
+  p_msc_scsi_lookup = ftl_lookup;
+  p_msc_scsi_discard = ftl_discard;
+  msc_scsi_discard_zero = 0;
+  return ftl_lbas;
+}
+
+/*
+ * Statistics of wear: least and most erase counts.
+ */
+void
+fraucheky_ftl_wear (uint32_t *min_p, uint32_t *max_p)
+{
+  unsigned int p;
+
+  *min_p = 0xffff;
+  *max_p = 0;
+  for (p = 0; p < ftl_pages; p++)
+    {
+      if (ftl_erase[p] < *min_p)
+	*min_p = ftl_erase[p];
+      if (ftl_erase[p] > *max_p)
+	*max_p = ftl_erase[p];
+    }
+}
+#endif
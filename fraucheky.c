@@ -27,22 +27,69 @@
 #include <stdlib.h>
 #include "usb_lld.h"
 #include "config.h"
-
-/* MSC BULK_IN, BULK_OUT */
-/* EP6: 64-byte, 64-byte */
-#define ENDP6_TXADDR        (0x180)
-#define ENDP6_RXADDR        (0x1c0)
+#include "usb-msc.h"
+#include "disk-on-rom.h"
 
 #define USB_INITIAL_FEATURE 0x80   /* bmAttributes: bus powered */
 
 #define MSC_GET_MAX_LUN_COMMAND        0xFE
 #define MSC_MASS_STORAGE_RESET_COMMAND 0xFF
 
+#ifdef SECTOR_CRC
+/*
+ * Vendor request (IN, to the interface) to check the volume by
+ * CRC-32.  It checks FRAUCHEKY_SELF_TEST_SECTORS sectors from the LBA
+ * of wValue times that, so that EP0 is not blocked for long.  Reply
+ * is 12 bytes: number of bad sectors, the first bad LBA (0xffffffff
+ * if none), and the number of sectors of the volume, in little
+ * endian.
+ */
+#define FRAUCHEKY_SELF_TEST_COMMAND    0x01
+
+#ifndef FRAUCHEKY_SELF_TEST_SECTORS
+#define FRAUCHEKY_SELF_TEST_SECTORS    16
+#endif
+#endif
+
+#ifndef BOS_DESCRIPTOR
+#define BOS_DESCRIPTOR               0x0f
+#endif
+#ifndef DEVICE_CAPABILITY_DESCRIPTOR
+#define DEVICE_CAPABILITY_DESCRIPTOR 0x10
+#endif
+
+/*
+ * With FRAUCHEKY_BOS, bcdUSB is 2.1 and BOS descriptor is provided,
+ * so that hosts don't need to guess.  With FRAUCHEKY_MS_VENDOR_CODE,
+ * it includes the platform capability of MS OS 2.0, and Windows gets
+ * the descriptor set by the vendor request of that code.  The set is
+ * the header followed by FRAUCHEKY_MS_OS_20_FEATURES (of
+ * FRAUCHEKY_MS_OS_20_FEATURES_LENGTH bytes) of config.h.
+ *
+ * DEVICE_QUALIFIER is not provided: the device is full-speed only,
+ * and such a device should answer with request error (USB 2.0 9.6.2).
+ */
+#if defined(FRAUCHEKY_MS_VENDOR_CODE) && !defined(FRAUCHEKY_BOS)
+#define FRAUCHEKY_BOS
+#endif
+
+#ifndef FRAUCHEKY_MS_OS_20_FEATURES_LENGTH
+#define FRAUCHEKY_MS_OS_20_FEATURES_LENGTH 0
+#define FRAUCHEKY_MS_OS_20_FEATURES
+#endif
+
+#define MS_OS_20_DESCRIPTOR_INDEX 7
+#define MS_OS_20_SET_LENGTH       (10+FRAUCHEKY_MS_OS_20_FEATURES_LENGTH)
+
 /* USB Standard Device Descriptor */
 static const uint8_t device_desc[] = {
   18,   /* bLength */
   DEVICE_DESCRIPTOR,     /* bDescriptorType */
+#ifdef FRAUCHEKY_BOS
+  0x10, 0x02,   /* bcdUSB = 2.1 */
+#else
   0x10, 0x01,   /* bcdUSB = 1.1 */
+#endif
   0x00,   /* bDeviceClass: 0 means deferred to interface */
   0x00,   /* bDeviceSubClass */
   0x00,   /* bDeviceProtocol */
@@ -54,48 +101,70 @@ static const uint8_t device_desc[] = {
   1  /* bNumConfigurations */
 };
 
-#define MSC_TOTAL_LENGTH (9+7+7)
-
 /* Configuation Descriptor */
 static const uint8_t config_desc[] = {
   9,			         /* bLength: Configuation Descriptor size */
   CONFIG_DESCRIPTOR,             /* bDescriptorType: Configuration */
-  (9+9+7+7), 0x00,               /* wTotalLength:no of returned bytes */
+  (9+FRAUCHEKY_MSC_DESC_LENGTH), 0x00, /* wTotalLength:no of returned bytes */
   1,				 /* bNumInterfaces: */
   0x01,                          /* bConfigurationValue: Configuration value */
   0x00,				 /* iConfiguration.  */
   USB_INITIAL_FEATURE,		 /* bmAttributes*/
   50,				 /* MaxPower 100 mA */
 
-  /* Interface Descriptor.*/
-  9,			         /* bLength: Interface Descriptor size */
-  INTERFACE_DESCRIPTOR,          /* bDescriptorType: Interface         */
-  0,				 /* bInterfaceNumber.                  */
-  0x00,				 /* bAlternateSetting.                 */
-  0x02,				 /* bNumEndpoints.                     */
-  0x08,				 /* bInterfaceClass (Mass Stprage).    */
-  0x06,				 /* bInterfaceSubClass (SCSI
-				    transparent command set, MSCO
-				    chapter 2).                        */
-  0x50,				 /* bInterfaceProtocol (Bulk-Only
-				    Mass Storage, MSCO chapter 3).     */
-  0x00,				 /* iInterface.                        */
-  /* Endpoint Descriptor.*/
-  7,			         /* bLength: Endpoint Descriptor size  */
-  ENDPOINT_DESCRIPTOR,   	 /* bDescriptorType: Endpoint          */
-  0x86,				 /* bEndpointAddress: (IN6)            */
-  0x02,				 /* bmAttributes (Bulk).               */
-  0x40, 0x00,			 /* wMaxPacketSize.                    */
-  0x00,				 /* bInterval (ignored for bulk).      */
-  /* Endpoint Descriptor.*/
-  7,			         /* bLength: Endpoint Descriptor size  */
-  ENDPOINT_DESCRIPTOR,   	 /* bDescriptorType: Endpoint          */
-  0x06,				 /* bEndpointAddress: (OUT6)           */
-  0x02,				 /* bmAttributes (Bulk).               */
-  0x40, 0x00,			 /* wMaxPacketSize.                    */
-  0x00,				 /* bInterval (ignored for bulk).      */
+  FRAUCHEKY_MSC_DESC
 };
 
+#ifdef FRAUCHEKY_BOS
+#ifdef FRAUCHEKY_MS_VENDOR_CODE
+#define BOS_TOTAL_LENGTH (5+7+28)
+#define BOS_NUM_CAPS     2
+#else
+#define BOS_TOTAL_LENGTH (5+7)
+#define BOS_NUM_CAPS     1
+#endif
+
+/* Binary device Object Store Descriptor */
+static const uint8_t bos_desc[] = {
+  5,				/* bLength */
+  BOS_DESCRIPTOR,		/* bDescriptorType */
+  BOS_TOTAL_LENGTH, 0x00,	/* wTotalLength */
+  BOS_NUM_CAPS,			/* bNumDeviceCaps */
+
+  /* USB 2.0 Extension */
+  7,				/* bLength */
+  DEVICE_CAPABILITY_DESCRIPTOR, /* bDescriptorType */
+  0x02,				/* bDevCapabilityType: USB 2.0 Extension */
+  0x00, 0x00, 0x00, 0x00,	/* bmAttributes: no LPM */
+
+#ifdef FRAUCHEKY_MS_VENDOR_CODE
+  /* Platform: MS OS 2.0 */
+  28,				/* bLength */
+  DEVICE_CAPABILITY_DESCRIPTOR, /* bDescriptorType */
+  0x05,				/* bDevCapabilityType: Platform */
+  0x00,				/* bReserved */
+  /* PlatformCapabilityUUID: D8DD60DF-4589-4CC7-9CD2-659D9E648A9F */
+  0xdf, 0x60, 0xdd, 0xd8, 0x89, 0x45, 0xc7, 0x4c,
+  0x9c, 0xd2, 0x65, 0x9d, 0x9e, 0x64, 0x8a, 0x9f,
+  0x00, 0x00, 0x03, 0x06,	/* dwWindowsVersion: Windows 8.1 */
+  MS_OS_20_SET_LENGTH & 0xff, MS_OS_20_SET_LENGTH >> 8, /* wLength */
+  FRAUCHEKY_MS_VENDOR_CODE,	/* bMS_VendorCode */
+  0x00,				/* bAltEnumCode */
+#endif
+};
+#endif
+
+#ifdef FRAUCHEKY_MS_VENDOR_CODE
+/* MS OS 2.0 Descriptor Set */
+static const uint8_t ms_os_20_desc_set[] = {
+  10, 0x00,			/* wLength */
+  0x00, 0x00,			/* wDescriptorType: Set Header */
+  0x00, 0x00, 0x03, 0x06,	/* dwWindowsVersion: Windows 8.1 */
+  MS_OS_20_SET_LENGTH & 0xff, MS_OS_20_SET_LENGTH >> 8, /* wTotalLength */
+  FRAUCHEKY_MS_OS_20_FEATURES
+};
+#endif
+
 
 /* USB String Descriptors */
 static const uint8_t string_lang_id[] = {
@@ -123,28 +192,98 @@ static const struct desc string_descriptors[] = {
   {string_serial, sizeof (string_serial)},
 };
 
-void
-fraucheky_setup_endpoints_for_interface (struct usb_dev *dev, int stop)
+#ifdef FRAUCHEKY_UAS
+static uint8_t fraucheky_alt;
+#endif
+
+static void
+fraucheky_setup_endpoints (struct usb_dev *dev, int stop)
 {
   extern void fraucheky_reset (void);
 
   if (!stop)
     {
 #ifdef GNU_LINUX_EMULATION
-      usb_lld_setup_endp (dev, ENDP6, 1, 1);
+      usb_lld_setup_endp (dev, FRAUCHEKY_ENDP, 1, 1);
+#ifdef FRAUCHEKY_UAS
+      if (fraucheky_alt)
+	usb_lld_setup_endp (dev, FRAUCHEKY_UAS_ENDP, 1, 1);
+#endif
 #else
       (void)dev;
-      usb_lld_setup_endpoint (ENDP6, EP_BULK, 0, ENDP6_RXADDR, ENDP6_TXADDR, 64);
+      usb_lld_setup_endpoint (FRAUCHEKY_ENDP, EP_BULK, 0,
+			      FRAUCHEKY_ENDP_RXADDR, FRAUCHEKY_ENDP_TXADDR, 64);
+#ifdef FRAUCHEKY_UAS
+      if (fraucheky_alt)
+	usb_lld_setup_endpoint (FRAUCHEKY_UAS_ENDP, EP_BULK, 0,
+				FRAUCHEKY_UAS_ENDP_RXADDR,
+				FRAUCHEKY_UAS_ENDP_TXADDR, 64);
+      else
+	{
+	  usb_lld_stall_tx (FRAUCHEKY_UAS_ENDP);
+	  usb_lld_stall_rx (FRAUCHEKY_UAS_ENDP);
+	}
+#endif
 #endif
       fraucheky_reset ();
     }
   else
     {
-      usb_lld_stall_tx (ENDP6);
-      usb_lld_stall_rx (ENDP6);
+      usb_lld_stall_tx (FRAUCHEKY_ENDP);
+      usb_lld_stall_rx (FRAUCHEKY_ENDP);
+#ifdef FRAUCHEKY_UAS
+      usb_lld_stall_tx (FRAUCHEKY_UAS_ENDP);
+      usb_lld_stall_rx (FRAUCHEKY_UAS_ENDP);
+#endif
     }
 }
 
+/* For SET_CONFIGURATION, it starts with Bulk-Only Transport.  */
+void
+fraucheky_setup_endpoints_for_interface (struct usb_dev *dev, int stop)
+{
+#ifdef FRAUCHEKY_UAS
+  extern void msc_uas_set (int on);
+
+  fraucheky_alt = 0;
+  msc_uas_set (0);
+#endif
+  fraucheky_setup_endpoints (dev, stop);
+}
+
+/* For SET_INTERFACE.  It returns -1 for unknown ALT.  */
+int
+fraucheky_set_alt (struct usb_dev *dev, uint16_t alt)
+{
+#ifdef FRAUCHEKY_UAS
+  extern void msc_uas_set (int on);
+
+  if (alt > 1)
+    return -1;
+
+  fraucheky_alt = alt;
+  fraucheky_setup_endpoints (dev, 0);
+  msc_uas_set (alt);
+  return 0;
+#else
+  if (alt != 0)
+    return -1;
+
+  fraucheky_setup_endpoints (dev, 0);
+  return 0;
+#endif
+}
+
+uint8_t
+fraucheky_get_alt (void)
+{
+#ifdef FRAUCHEKY_UAS
+  return fraucheky_alt;
+#else
+  return 0;
+#endif
+}
+
 int
 fraucheky_setup (struct usb_dev *dev)
 {
@@ -152,6 +291,50 @@ fraucheky_setup (struct usb_dev *dev)
 
   static const uint8_t lun_table[] = { 0, 0, 0, 0, };
 
+  if ((arg->type & REQUEST_TYPE) == VENDOR_REQUEST)
+    {
+#ifdef SECTOR_CRC
+      extern uint32_t msc_self_test (uint32_t lba, uint32_t count,
+				     uint32_t *lba_p);
+      extern uint32_t msc_scsi_capacity (void);
+      static uint8_t self_test_result[12];
+      uint32_t v[3];
+      int i;
+#endif
+
+      if (!USB_SETUP_GET (arg->type))
+	return -1;
+
+#ifdef FRAUCHEKY_MS_VENDOR_CODE
+      if (arg->request == FRAUCHEKY_MS_VENDOR_CODE
+	  && (arg->type & RECIPIENT) == DEVICE_RECIPIENT
+	  && arg->index == MS_OS_20_DESCRIPTOR_INDEX)
+	return usb_lld_ctrl_send (dev, ms_os_20_desc_set,
+				  sizeof (ms_os_20_desc_set));
+#endif
+
+#ifdef SECTOR_CRC
+      if (arg->request == FRAUCHEKY_SELF_TEST_COMMAND
+	  && (arg->type & RECIPIENT) == INTERFACE_RECIPIENT
+	  && arg->index == FRAUCHEKY_INTERFACE)
+	{
+	  v[0] = msc_self_test (arg->value * FRAUCHEKY_SELF_TEST_SECTORS,
+				FRAUCHEKY_SELF_TEST_SECTORS, &v[1]);
+	  v[2] = msc_scsi_capacity ();
+	  for (i = 0; i < 12; i++)
+	    self_test_result[i] = v[i / 4] >> ((i % 4) * 8);
+	  return usb_lld_ctrl_send (dev, self_test_result,
+				    sizeof (self_test_result));
+	}
+#endif
+
+      return -1;
+    }
+
+  /* In a composite device, requests may be for other interfaces.  */
+  if (arg->index != FRAUCHEKY_INTERFACE)
+    return -1;
+
   if (USB_SETUP_GET (arg->type))
     {
       if (arg->request == MSC_GET_MAX_LUN_COMMAND)
@@ -178,6 +361,10 @@ fraucheky_get_descriptor (struct usb_dev *dev)
 	return usb_lld_ctrl_send (dev, device_desc, sizeof (device_desc));
       else if (desc_type == CONFIG_DESCRIPTOR && arg->index == 0)
 	return usb_lld_ctrl_send (dev, config_desc, sizeof (config_desc));
+#ifdef FRAUCHEKY_BOS
+      else if (desc_type == BOS_DESCRIPTOR && arg->index == 0)
+	return usb_lld_ctrl_send (dev, bos_desc, sizeof (bos_desc));
+#endif
       else if (desc_type == STRING_DESCRIPTOR)
 	{
 	  if (desc_index >= sizeof (string_descriptors) / sizeof (struct desc)
@@ -3,6 +3,12 @@
 
 #define MSC_CSW_STATUS_PASSED 0
 #define MSC_CSW_STATUS_FAILED 1
+#define MSC_CSW_STATUS_PHASE_ERROR 2
+
+/* Logical block size: 512, 2048, or 4096.  */
+#ifndef MSC_SECTOR_SIZE
+#define MSC_SECTOR_SIZE 512
+#endif
 
 #define SCSI_INQUIRY                0x12
 #define SCSI_MODE_SENSE6            0x1A
@@ -14,10 +20,20 @@
 #define SCSI_TEST_UNIT_READY        0x00
 #define SCSI_WRITE10                0x2A
 #define SCSI_VERIFY10               0x2F
+#define SCSI_VERIFY10_BYTCHK        0x02
 #define SCSI_READ_FORMAT_CAPACITIES 0x23
 #define SCSI_SYNCHRONIZE_CACHE      0x35
 #define SCSI_ATA_16                 0x85
 #define SCSI_REPORT_LUN             0xA0
+#define SCSI_WRITE_SAME10           0x41
+#define SCSI_UNMAP                  0x42
+#define SCSI_WRITE_SAME16           0x93
+#define SCSI_SERVICE_ACTION_IN16    0x9E
+#define SCSI_SAI_READ_CAPACITY16    0x10
+#define SCSI_READ_TOC               0x43
+#define SCSI_GET_CONFIGURATION      0x46
+#define SCSI_GET_EVENT_STATUS       0x4A
+#define SCSI_MODE_SENSE10           0x5A
 
 #define MSC_IDLE        0
 #define MSC_DATA_OUT    1
@@ -43,6 +59,115 @@ struct CSW {
 } __attribute__((packed));
 
 #define SCSI_ERROR_NOT_READY 2
+#define SCSI_ERROR_MEDIUM_ERROR 3
 #define SCSI_ERROR_ILLEAGAL_REQUEST 5
 #define SCSI_ERROR_UNIT_ATTENTION 6
 #define SCSI_ERROR_DATA_PROTECT 7
+#define SCSI_ERROR_MISCOMPARE 0x0e
+
+uint32_t msc_crc32 (const uint8_t *p, size_t n);
+
+/*
+ * Commands added by the application with msc_register_command.
+ *
+ * HANDLER is called with CDB.  For MSC_DIR_IN, it fills DATA (up to
+ * MSC_SECTOR_SIZE bytes) and sets *LEN_P.  For MSC_DIR_OUT, DATA has
+ * *LEN_P bytes received; a command with more than MSC_SECTOR_SIZE
+ * bytes is rejected by phase error, without calling HANDLER.  It
+ * returns 0 on success, or MSC_SENSE (KEY, ASC) for CHECK CONDITION.
+ *
+ * Registration should be done before the MSC thread starts.  It
+ * returns -1 when OPCODE is handled by Fraucheky, or the table of
+ * MSC_USER_COMMANDS entries is full.
+ */
+#define MSC_DIR_NONE 0
+#define MSC_DIR_IN   1
+#define MSC_DIR_OUT  2
+
+#define MSC_SENSE(key, asc) (((asc) << 8) | (key))
+
+typedef int (*msc_command_handler_t) (const uint8_t *cdb, uint8_t *data,
+				      size_t *len_p);
+
+int msc_register_command (uint8_t opcode, uint8_t dir,
+			  msc_command_handler_t handler);
+
+/*
+ * Medium served by usb-msc.c.  WRITE and VERIFY may be NULL (write
+ * protected, and no check, respectively).  The default is the
+ * backend of msc_scsi_read, msc_scsi_write and msc_scsi_verify.
+ *
+ * DISCARD is for UNMAP and WRITE SAME with UNMAP bit, to tell COUNT
+ * sectors from LBA are no longer used.  It shouldn't use the sector
+ * buffer of the backend.  When it's NULL, logical block provisioning
+ * is not advertised.  When DISCARD_ZERO is non-zero, the sectors read
+ * as zeros after that (LBPRZ).  Otherwise, they may read as any data,
+ * and WRITE SAME with UNMAP bit writes zeros instead.
+ *
+ * SUBMIT is for asynchronous read, see below.  When it's NULL, READ
+ * is used.
+ *
+ * LOOKUP is for sectors which are constant (e.g. on ROM).  It returns
+ * 0 with the sector at LBA, or non-zero when READ is needed.  It is
+ * called by the USB callback, so, it should not block, and should not
+ * use the sector buffer of the backend.  It may be NULL.
+ */
+struct msc_request;
+
+struct msc_medium {
+  uint32_t nblocks;
+  int (*read) (uint32_t lba, const uint8_t **sector_p);
+  int (*write) (uint32_t lba, const uint8_t *buf, size_t size);
+  int (*verify) (uint32_t lba);
+  int (*discard) (uint32_t lba, uint32_t count);
+  int (*submit) (struct msc_request *req);
+  int (*lookup) (uint32_t lba, const uint8_t **sector_p);
+  uint8_t discard_zero;
+};
+
+/*
+ * Asynchronous read.  READ(10) keeps up to MSC_ASYNC_WINDOW requests
+ * in flight, so that the backend fetches next sectors while the
+ * current sector is sent to the host.
+ *
+ * SUBMIT queues REQ and returns 0, or returns an error without
+ * queuing.  The backend reads the sector at LBA by its own thread,
+ * sets SECTOR (valid until REQ is submitted again) and STATUS, and
+ * calls COMPLETE.  COMPLETE takes the lock of MSC, so, it should not
+ * be called from SUBMIT.
+ */
+#ifndef MSC_ASYNC_WINDOW
+#define MSC_ASYNC_WINDOW 2
+#endif
+
+struct msc_request {
+  struct msc_request *next;	/* For the queue of the backend.  */
+  uint32_t lba;
+  const uint8_t *sector;
+  int status;
+  void (*complete) (struct msc_request *req);
+  uint8_t done;
+};
+
+uint32_t msc_media_swap (const struct msc_medium *m);
+
+/*
+ * Sectors from LBA, COUNT sectors.  For the mount profile recorded
+ * by MSC_MOUNT_PROFILE (msc_mount_profile of msc_mount_profile_len
+ * entries), and the profile of sectors pinned in RAM by
+ * MSC_PIN_SECTORS (MSC_PIN_PROFILE of config.h, or msc_pin_set).
+ */
+struct msc_extent {
+  uint32_t lba;
+  uint32_t count;
+};
+
+void msc_pin_set (const struct msc_extent *profile, uint32_t n);
+
+/*
+ * A backend reports an error found after the command completed (e.g.
+ * by write-back) at LBA.  It's reported to the host as deferred error
+ * by the next command.  Call it with holding the lock of MSC (from
+ * the methods of the medium).
+ */
+void msc_deferred_error (uint8_t sense_key, uint8_t asc, uint32_t lba);
@@ -1,6 +1,15 @@
 # Fraucheky make rules.
 
 CSRC += $(FRAUCHEKY)/fraucheky.c $(FRAUCHEKY)/usb-msc.c \
-	$(FRAUCHEKY)/disk-on-rom.c
+	$(FRAUCHEKY)/disk-on-rom.c $(FRAUCHEKY)/disk-on-file.c \
+	$(FRAUCHEKY)/disk-slow.c $(FRAUCHEKY)/disk-fault.c \
+	$(FRAUCHEKY)/flash-ftl.c $(FRAUCHEKY)/disk-crypt.c
 
-OBJS_ADD += $(BUILDDIR)/COPYING.o $(BUILDDIR)/README.o $(BUILDDIR)/INDEX.o
+ifeq ($(FRAUCHEKY_DEDUP),yes)
+FRAUCHEKY_BLOBS = $(BUILDDIR)/SECTORS.o
+else
+FRAUCHEKY_BLOBS = $(BUILDDIR)/COPYING.o $(BUILDDIR)/README.o \
+		  $(BUILDDIR)/INDEX.o
+endif
+
+OBJS_ADD += $(FRAUCHEKY_BLOBS)
@@ -30,21 +30,116 @@
 #include "config.h"
 #include "usb_lld.h"
 #include "msc.h"
+#include "usb-msc.h"
 
 extern int msc_scsi_write (uint32_t lba, const uint8_t *buf, size_t size);
 extern int msc_scsi_read (uint32_t lba, const uint8_t **sector_p);
+extern int msc_scsi_verify (uint32_t lba);
+extern int msc_scsi_lookup (uint32_t lba, const uint8_t **sector_p);
+extern int msc_scsi_discard (uint32_t lba, uint32_t count);
+extern int (*p_msc_scsi_discard) (uint32_t lba, uint32_t count);
+extern uint8_t msc_scsi_discard_zero;
 extern void msc_scsi_stop (uint8_t code);
+extern uint32_t msc_scsi_capacity (void);
 
-#define MSC_SECTOR_SIZE 512
+/*
+ * The medium is published by msc_media_swap into msc_medium, under
+ * msc_mutex.  A command takes its snapshot into MEDIUM at its start,
+ * so that a command in flight continues with the old medium, while
+ * new commands see the new one.
+ */
+#ifdef MSC_CDROM
+#if MSC_SECTOR_SIZE != 2048
+#error "MSC_CDROM requires MSC_SECTOR_SIZE of 2048"
+#endif
+/* Read only.  */
+static struct msc_medium msc_medium_rom = {
+  0, msc_scsi_read, NULL, msc_scsi_verify, NULL, NULL, msc_scsi_lookup, 0
+};
+#else
+static struct msc_medium msc_medium_rom = {
+  0, msc_scsi_read, msc_scsi_write, msc_scsi_verify, NULL, NULL,
+  msc_scsi_lookup, 0
+};
+#endif
 
-static uint32_t number_of_blocks;
+static const struct msc_medium *msc_medium;
+static const struct msc_medium *medium;
+uint32_t msc_media_generation;
 
-#define RDY_OK    0
-#define RDY_RESET 1
+#define RDY_OK     0
+#define RDY_RESET  1
+#define RDY_RESUME 2
 static uint8_t msg;
 
 static chopstx_mutex_t msc_mutex;
 static chopstx_cond_t msc_cond;
+static chopstx_cond_t msc_request_cond;
+
+/*
+ * Cooperative scheduling of long transfers.
+ *
+ * A READ10/WRITE10 command with many sectors keeps the MSC thread
+ * busy for the whole transfer.  To give the application thread
+ * predictable latency, the transfer is cut into slices.  At the end
+ * of a slice, the MSC thread releases the lock, lowers its priority
+ * to PRIO_MSC_SLICE and lets other threads run.
+ *
+ * A slice ends after MSC_SLICE_SECTORS sectors (0 means no limit),
+ * or, when the application supplies a clock by p_msc_clock, after
+ * msc_slice_budget ticks of the clock (0 means no limit).
+ *
+ * With p_msc_clock, the longest time the MSC thread kept running
+ * without blocking is recorded in msc_latency_max.  It is the worst
+ * latency observed by a thread of lower priority.
+ */
+#ifndef MSC_SLICE_SECTORS
+#define MSC_SLICE_SECTORS 0
+#endif
+
+#ifndef MSC_SLICE_WAIT_USEC
+#define MSC_SLICE_WAIT_USEC 0
+#endif
+
+#ifndef PRIO_MSC_SLICE
+#define PRIO_MSC_SLICE 1
+#endif
+
+uint32_t (*p_msc_clock) (void);
+uint32_t msc_slice_budget;
+uint32_t msc_latency_max;
+
+static uint32_t slice_start;
+static uint32_t slice_sectors;
+static uint32_t run_start;
+
+/*
+ * Suspend of the bus.  While suspended, the MSC thread waits without
+ * starting any transfer; receiving CBW, when armed before suspend, is
+ * kept armed (cbw_armed), so that a CBW just after resume is not
+ * lost.  Sense data, the medium and the backend (its cache, overlay,
+ * etc.) are kept as they are, so that the host can continue by the
+ * next command after resume, without a round of TEST UNIT READY and
+ * REQUEST SENSE.
+ *
+ * With p_msc_clock, the time from fraucheky_resume to the end of the
+ * status of the first command is recorded in msc_resume_latency (and
+ * the longest one in msc_resume_latency_max).
+ */
+uint32_t msc_resume_latency;
+uint32_t msc_resume_latency_max;
+
+static uint8_t msc_suspended;
+static uint8_t resume_pending;
+static uint32_t resume_start;
+
+/*
+ * Receiving CBW is armed, and not yet taken by the MSC thread.  When
+ * the thread is woken for other reasons, it's kept, so that a CBW
+ * received meanwhile is not lost.  The endpoint configured again
+ * (fraucheky_reset) needs it armed again.
+ */
+static uint8_t cbw_armed;
 
 
 struct usb_endp_in {
@@ -66,6 +161,53 @@ static struct usb_endp_out ep6_out;
 
 static uint8_t msc_state;
 
+/*
+ * READ(10) is continued by EP6_IN_Callback across sectors, when the
+ * medium has LOOKUP and the next sector is found by it.  The MSC
+ * thread is woken only at the end of the command, or when a sector
+ * needs READ of the medium.
+ */
+static uint32_t read_chain_lba;	  /* Next sector.  */
+static uint32_t read_chain_count; /* Sectors remained for the chain.  */
+static uint32_t read_chain_sent;  /* Sectors sent by the callback.  */
+
+static int msc_read_chain (void);
+
+#ifdef FRAUCHEKY_UAS
+/*
+ * USB Attached SCSI, by alternate setting 1.  The command pipe (OUT)
+ * and the status pipe (IN) are FRAUCHEKY_UAS_ENDP, and data pipes are
+ * FRAUCHEKY_ENDP.  An information unit (IU) fits into a packet.
+ *
+ * Command IUs are queued up to MSC_UAS_QUEUE entries (tagged command
+ * queuing), and executed in order.  While the queue is full, the
+ * command pipe is not enabled, so that the host waits.  Before data
+ * of a command, READ READY or WRITE READY is sent on the status pipe
+ * (USB 2.0 has no streams), and sense data is sent with the status.
+ */
+#ifndef MSC_UAS_QUEUE
+#define MSC_UAS_QUEUE 4
+#endif
+
+#define UAS_IU_COMMAND         0x01
+#define UAS_IU_SENSE           0x03
+#define UAS_IU_RESPONSE        0x04
+#define UAS_IU_TASK_MANAGEMENT 0x05
+#define UAS_IU_READ_READY      0x06
+#define UAS_IU_WRITE_READY     0x07
+
+#define UAS_IU_SIZE 32
+
+static uint8_t msc_uas;		/* 1 when UAS is selected.  */
+static uint8_t uas_ready;	/* READY IU has been sent.  */
+static uint8_t uas_rx_armed;
+static uint8_t uas_count;
+static uint8_t uas_rx[ENDP_MAX_SIZE];
+static uint8_t uas_iu[MSC_UAS_QUEUE][UAS_IU_SIZE];
+
+static void uas_send_status (void);
+#endif
+
 
 #ifdef GNU_LINUX_EMULATION
 /*
@@ -81,17 +223,52 @@ usb_lld_write (uint8_t ep_num, const void *buf, size_t len)
 {
   usb_lld_tx_enable_buf (ep_num, buf, len);
 }
+
+/*
+ * Fault injection (see disk-fault.c).  P_MSC_PACKET_FAULT is called
+ * for each packet of FRAUCHEKY_ENDP (IN is 1 for transmit, 0 for
+ * receive), and returns the length to be used: less than LEN makes a
+ * short packet, and -1 drops the packet.  P_MSC_COMMAND_DONE is
+ * called at the end of each command of Bulk-Only Transport, with the
+ * status of CSW, or -1 when the endpoint is stalled.
+ */
+int (*p_msc_packet_fault) (int in, size_t len);
+void (*p_msc_command_done) (int status);
+
+#define MSC_COMMAND_DONE(status) \
+  do { if (p_msc_command_done) (*p_msc_command_done) (status); } while (0)
+#else
+#define MSC_COMMAND_DONE(status)
 #endif
 
-static void usb_start_transmit (const uint8_t *p, size_t n)
+static void usb_transmit_packet (void)
 {
-  size_t pkt_len = n > ENDP_MAX_SIZE ? ENDP_MAX_SIZE : n;
+  size_t len = ep6_in.txsize > ENDP_MAX_SIZE ? ENDP_MAX_SIZE : ep6_in.txsize;
 
+#ifdef GNU_LINUX_EMULATION
+  if (p_msc_packet_fault)
+    {
+      int r = (*p_msc_packet_fault) (1, len);
+
+      if (r < 0)
+	/* Lost, the host will time out.  */
+	return;
+      else if ((size_t)r < len)
+	/* Short packet ends the transfer.  */
+	ep6_in.txsize = len = r;
+    }
+#endif
+
+  usb_lld_write (FRAUCHEKY_ENDP, ep6_in.txbuf, len);
+}
+
+static void usb_start_transmit (const uint8_t *p, size_t n)
+{
   ep6_in.txbuf = p;
   ep6_in.txsize = n;
   ep6_in.txcnt = 0;
 
-  usb_lld_write (ENDP6, ep6_in.txbuf, pkt_len);
+  usb_transmit_packet ();
 }
 
 /* "Data Transmitted" callback */
@@ -105,13 +282,10 @@ EP6_IN_Callback (uint16_t len)
   ep6_in.txsize -= len;
 
   if (ep6_in.txsize > 0)	/* More data to be sent */
-    {
-      if (ep6_in.txsize > ENDP_MAX_SIZE)
-	len = ENDP_MAX_SIZE;
-      else
-	len = ep6_in.txsize;
-      usb_lld_write (ENDP6, ep6_in.txbuf, len);
-    }
+    usb_transmit_packet ();
+  else if (msc_state == MSC_DATA_IN && read_chain_count
+	   && msc_read_chain () == 0)
+    ;
   else
     /* Transmit has been completed, notify the waiting thread */
     switch (msc_state)
@@ -145,9 +319,9 @@ static void usb_start_receive (uint8_t *p, size_t n)
   ep6_out.rxsize = n;
   ep6_out.rxcnt = 0;
 #ifdef GNU_LINUX_EMULATION
-  usb_lld_rx_enable_buf (ENDP6, ep6_out.rxbuf, usb_buf_size (ep6_out.rxsize));
+  usb_lld_rx_enable_buf (FRAUCHEKY_ENDP, ep6_out.rxbuf, usb_buf_size (ep6_out.rxsize));
 #else
-  usb_lld_rx_enable (ENDP6);
+  usb_lld_rx_enable (FRAUCHEKY_ENDP);
 #endif
 }
 
@@ -166,8 +340,16 @@ EP6_OUT_Callback (uint16_t len)
       n = ep6_out.rxsize;
     }
 
+#ifdef GNU_LINUX_EMULATION
+  if (p_msc_packet_fault && (*p_msc_packet_fault) (0, n) < 0)
+    {				/* Lost packet */
+      err = 1;
+      n = 0;
+    }
+#endif
+
 #ifndef GNU_LINUX_EMULATION
-  usb_lld_rxcpy (ep6_out.rxbuf, ENDP6, 0, n);
+  usb_lld_rxcpy (ep6_out.rxbuf, FRAUCHEKY_ENDP, 0, n);
 #endif
   ep6_out.rxbuf += n;
   ep6_out.rxcnt += n;
@@ -175,9 +357,9 @@ EP6_OUT_Callback (uint16_t len)
 
   if (n == ENDP_MAX_SIZE && ep6_out.rxsize != 0) /* More data to be received */
 #ifdef GNU_LINUX_EMULATION
-    usb_lld_rx_enable_buf (ENDP6, ep6_out.rxbuf, usb_buf_size (ep6_out.rxsize));
+    usb_lld_rx_enable_buf (FRAUCHEKY_ENDP, ep6_out.rxbuf, usb_buf_size (ep6_out.rxsize));
 #else
-    usb_lld_rx_enable (ENDP6);
+    usb_lld_rx_enable (FRAUCHEKY_ENDP);
 #endif
   else
     /* Receiving has been completed, notify the waiting thread */
@@ -195,6 +377,64 @@ EP6_OUT_Callback (uint16_t len)
   chopstx_mutex_unlock (&msc_mutex);
 }
 
+#ifdef FRAUCHEKY_UAS
+static void uas_start_receive (void)
+{
+  uas_rx_armed = 1;
+#ifdef GNU_LINUX_EMULATION
+  usb_lld_rx_enable_buf (FRAUCHEKY_UAS_ENDP, uas_rx, sizeof uas_rx);
+#else
+  usb_lld_rx_enable (FRAUCHEKY_UAS_ENDP);
+#endif
+}
+
+/* "Data Transmitted" call back of the status pipe */
+void
+EP7_IN_Callback (uint16_t len)
+{
+  (void)len;
+
+  chopstx_mutex_lock (&msc_mutex);
+  if (msc_state == MSC_SENDING_CSW)
+    {
+      msg = RDY_OK;
+      chopstx_cond_signal (&msc_cond);
+    }
+  chopstx_mutex_unlock (&msc_mutex);
+}
+
+/* "Data Received" call back of the command pipe */
+void
+EP7_OUT_Callback (uint16_t len)
+{
+  size_t n = len > UAS_IU_SIZE ? UAS_IU_SIZE : len;
+
+  chopstx_mutex_lock (&msc_mutex);
+
+#ifndef GNU_LINUX_EMULATION
+  usb_lld_rxcpy (uas_rx, FRAUCHEKY_UAS_ENDP, 0, n);
+#endif
+  uas_rx_armed = 0;
+
+  if (msc_uas && n >= 4)	/* Shorter one is ignored.  */
+    {
+      memset (uas_iu[uas_count], 0, UAS_IU_SIZE);
+      memcpy (uas_iu[uas_count], uas_rx, n);
+      uas_count++;
+      if (msc_state == MSC_IDLE)
+	{
+	  msg = RDY_OK;
+	  chopstx_cond_signal (&msc_cond);
+	}
+    }
+
+  if (msc_uas && uas_count < MSC_UAS_QUEUE)
+    uas_start_receive ();
+
+  chopstx_mutex_unlock (&msc_mutex);
+}
+#endif
+
 static const uint8_t scsi_inquiry_data_00[] = { 0, 0, 0, 0, 0 };
 
 static const uint8_t scsi_inquiry_data_83[] = {
@@ -205,7 +445,11 @@ static const uint8_t scsi_inquiry_data_83[] = {
 };
 
 static const uint8_t scsi_inquiry_data[] = {
+#ifdef MSC_CDROM
+  0x05,				/* CD/DVD Device.             */
+#else
   0x00,				/* Direct Access Device.      */
+#endif
   0x80,				/* RMB = 1: Removable Medium. */
   0x00,				/* Version: does not claim conformance.  */
   0x02,				/* Response format: SPC-3.    */
@@ -222,68 +466,359 @@ static const uint8_t scsi_inquiry_data[] = {
   '1', '.', '0', ' '
 };
 
-static uint8_t scsi_sense_data_desc[] = {
-  0x72,			  /* Response Code: descriptor, current */
-  0x02,			  /* Sense Key */
-  0x3a,			  /* ASC (additional sense code) */
-  0x00,			  /* ASCQ (additional sense code qualifier) */
-  0x00, 0x00, 0x00,
-  0x00,			  /* Additional Sense Length */
+/*
+ * Sense data.
+ *
+ * SENSE is for the last command which ended with CHECK CONDITION,
+ * and it's reported by REQUEST SENSE.  Other commands clear it.
+ *
+ * Unit attention (change of the medium) and deferred error (of the
+ * backend) are queued in sense_queue.  The head of the queue is
+ * reported by the next command (other than INQUIRY and REPORT LUNS)
+ * as CHECK CONDITION, or directly by REQUEST SENSE, so that the host
+ * knows it in a single exchange.
+ *
+ * Not ready status is not kept, but checked by each command.
+ */
+#define SENSE_INFO     0x01	/* INFO is valid.  */
+#define SENSE_DEFERRED 0x02	/* Deferred error.  */
+
+#define SENSE_FIXED_LENGTH 18
+#define SENSE_DESC_LENGTH  8
+#define SENSE_DESC_INFO_LENGTH 12
+
+struct msc_sense {
+  uint8_t key;
+  uint8_t asc;
+  uint8_t ascq;
+  uint8_t flags;
+  uint32_t info;
 };
 
-static uint8_t scsi_sense_data_fixed[] = {
-  0x70,			  /* Response Code: fixed, current */
-  0x00,
-  0x02,			  /* Sense Key */
-  0x00, 0x00, 0x00, 0x00,
-  0x0a,			  /* Additional Sense Length */
-  0x00, 0x00, 0x00, 0x00,
-  0x3a,			  /* ASC (additional sense code) */
-  0x00,			  /* ASCQ (additional sense code qualifier) */
-  0x00,
-  0x00, 0x00, 0x00,
-};
+#ifndef MSC_SENSE_QUEUE
+#define MSC_SENSE_QUEUE 4
+#endif
+
+static struct msc_sense sense;
+static struct msc_sense sense_queue[MSC_SENSE_QUEUE];
+static uint8_t sense_queue_head;
+static uint8_t sense_queue_len;
 
-static void set_scsi_sense_data(uint8_t sense_key, uint8_t asc)
+/* called with holding the lock.  */
+static void
+msc_set_sense (uint8_t key, uint8_t asc, uint8_t ascq, uint8_t flags,
+	       uint32_t info)
 {
-  scsi_sense_data_desc[1] = scsi_sense_data_fixed[2] = sense_key;
-  scsi_sense_data_desc[2] = scsi_sense_data_fixed[12] = asc;
+  sense.key = key;
+  sense.asc = asc;
+  sense.ascq = ascq;
+  sense.flags = flags;
+  sense.info = info;
 }
 
+/* called with holding the lock.  */
+static void
+sense_queue_put (uint8_t key, uint8_t asc, uint8_t ascq, uint8_t flags,
+		 uint32_t info)
+{
+  struct msc_sense *s;
+  int i;
 
-static uint8_t buf[512];
+  /* Same unit attention is reported only once.  */
+  if (!(flags & SENSE_DEFERRED))
+    for (i = 0; i < sense_queue_len; i++)
+      {
+	s = &sense_queue[(sense_queue_head + i) % MSC_SENSE_QUEUE];
+	if (s->key == key && s->asc == asc && s->ascq == ascq)
+	  return;
+      }
 
-static uint8_t contingent_allegiance;
-static uint8_t keep_contingent_allegiance;
+  /* When it's full, the last one is replaced.  */
+  if (sense_queue_len == MSC_SENSE_QUEUE)
+    sense_queue_len--;
+
+  s = &sense_queue[(sense_queue_head + sense_queue_len) % MSC_SENSE_QUEUE];
+  s->key = key;
+  s->asc = asc;
+  s->ascq = ascq;
+  s->flags = flags;
+  s->info = info;
+  sense_queue_len++;
+}
 
-#define MEDIA_AVAILABLE() (number_of_blocks != 0)
+/* called with holding the lock.  Move the head of the queue to SENSE.  */
+static int
+sense_queue_get (void)
+{
+  if (sense_queue_len == 0)
+    return 0;
 
-static void
-msc_media_insert_change (uint32_t nblocks)
+  sense = sense_queue[sense_queue_head];
+  sense_queue_head = (sense_queue_head + 1) % MSC_SENSE_QUEUE;
+  sense_queue_len--;
+  return 1;
+}
+
+/*
+ * Report an error of the backend, found after the command completed
+ * (e.g. write-back).  It's called by the backend (with holding the
+ * lock).
+ */
+void
+msc_deferred_error (uint8_t sense_key, uint8_t asc, uint32_t lba)
 {
-  chopstx_mutex_lock (&msc_mutex);
+  sense_queue_put (sense_key, asc, 0, SENSE_DEFERRED | SENSE_INFO, lba);
+}
 
-  number_of_blocks = nblocks;
-  contingent_allegiance = 1;
-  if (MEDIA_AVAILABLE ())
+
+/*
+ * Minimal-RAM profile.
+ *
+ * With MSC_MINIMAL_RAM, the sector buffer of the backend and the
+ * buffer here are merged into MSC_ARENA.  It's safe because the
+ * backend fills its sector only for READ10, while the buffer here
+ * is used for other commands and data of WRITE10.
+ */
+#ifdef MSC_MINIMAL_RAM
+#ifndef MSC_ARENA_SIZE
+#define MSC_ARENA_SIZE MSC_SECTOR_SIZE
+#endif
+#if MSC_ARENA_SIZE < MSC_SECTOR_SIZE
+#error "MSC_ARENA_SIZE should be larger than MSC_SECTOR_SIZE"
+#endif
+uint8_t msc_arena[MSC_ARENA_SIZE];
+#define buf msc_arena
+#else
+static uint8_t buf[MSC_SECTOR_SIZE];
+#endif
+
+/* Stopped by START STOP UNIT.  */
+static uint8_t medium_stopped;
+
+#ifdef MSC_CDROM
+/* Event code of media class, for GET EVENT STATUS NOTIFICATION.  */
+static uint8_t mmc_media_event;
+#endif
+
+#define MEDIA_PRESENT() (medium != NULL && medium->nblocks != 0)
+#define MEDIA_AVAILABLE() (MEDIA_PRESENT () && !medium_stopped)
+
+/*
+ * Mount profile.  With MSC_MOUNT_PROFILE, READ(10) commands among
+ * the first MSC_MOUNT_PROFILE commands after the change of the medium
+ * are recorded in msc_mount_profile, in order.  It's the sequence of
+ * sectors which the host reads to mount the volume (MBR, FATs, root
+ * directory, etc.).
+ *
+ * Pinned sectors.  With MSC_PIN_SECTORS, sectors of a profile (given
+ * by MSC_PIN_PROFILE of config.h, or by msc_pin_set) are read into
+ * RAM when the medium is changed (at boot, too), before the host asks
+ * for them.  READ(10) of those sectors is served from RAM, without
+ * the backend.  A sector is unpinned when it's written or discarded.
+ */
+#ifndef MSC_MOUNT_PROFILE
+#define MSC_MOUNT_PROFILE 0
+#endif
+
+#ifndef MSC_PIN_SECTORS
+#define MSC_PIN_SECTORS 0
+#endif
+
+#if MSC_MOUNT_PROFILE
+struct msc_extent msc_mount_profile[MSC_MOUNT_PROFILE];
+uint32_t msc_mount_profile_len;
+static uint32_t mount_commands;	/* Commands after the change.  */
+
+/* called with holding the lock.  */
+static void
+msc_mount_record (uint32_t lba, uint32_t count)
+{
+  if (mount_commands <= MSC_MOUNT_PROFILE
+      && msc_mount_profile_len < MSC_MOUNT_PROFILE)
     {
-      set_scsi_sense_data (0x06, 0x28); /* UNIT_ATTENTION */
-      keep_contingent_allegiance = 0;
+      msc_mount_profile[msc_mount_profile_len].lba = lba;
+      msc_mount_profile[msc_mount_profile_len].count = count;
+      msc_mount_profile_len++;
     }
+}
+#else
+#define msc_mount_record(lba, count)
+#endif
+
+#if MSC_PIN_SECTORS
+#ifdef MSC_PIN_PROFILE
+static const struct msc_extent pin_profile_default[] = { MSC_PIN_PROFILE };
+static const struct msc_extent *pin_profile = pin_profile_default;
+static uint32_t pin_profile_len =
+  sizeof pin_profile_default / sizeof pin_profile_default[0];
+#else
+static const struct msc_extent *pin_profile;
+static uint32_t pin_profile_len;
+#endif
+
+static uint8_t pin_data[MSC_PIN_SECTORS][MSC_SECTOR_SIZE];
+static uint32_t pin_lba[MSC_PIN_SECTORS];
+static uint32_t pin_num;
+static uint8_t pin_stage_pending;
+
+#define PIN_LBA_NONE 0xffffffff
+
+/*
+ * Set the profile of pinned sectors, before the MSC thread starts
+ * (or before msc_media_swap).  PROFILE should be kept valid.
+ */
+void
+msc_pin_set (const struct msc_extent *profile, uint32_t n)
+{
+  pin_profile = profile;
+  pin_profile_len = n;
+}
+
+/* called with holding the lock.  It may be called by EP6_IN_Callback.  */
+static const uint8_t *
+msc_pin_lookup (uint32_t lba)
+{
+  uint32_t i;
+
+  for (i = 0; i < pin_num; i++)
+    if (pin_lba[i] == lba)
+      return pin_data[i];
+
+  return NULL;
+}
+
+/* called with holding the lock.  */
+static void
+msc_pin_drop (uint32_t lba, uint32_t count)
+{
+  uint32_t i;
+
+  for (i = 0; i < pin_num; i++)
+    if (pin_lba[i] - lba < count)
+      pin_lba[i] = PIN_LBA_NONE;
+}
+
+/* called with holding the lock, by the MSC thread.  */
+static void
+msc_pin_stage (void)
+{
+  const uint8_t *p;
+  uint32_t i, lba;
+
+  pin_stage_pending = 0;
+  pin_num = 0;
+  medium = msc_medium;
+  if (!MEDIA_PRESENT ())
+    return;
+
+  for (i = 0; i < pin_profile_len; i++)
+    for (lba = pin_profile[i].lba;
+	 lba - pin_profile[i].lba < pin_profile[i].count; lba++)
+      {
+	if (pin_num >= MSC_PIN_SECTORS)
+	  return;
+	if (lba >= medium->nblocks || msc_pin_lookup (lba)
+	    || (*medium->read) (lba, &p))
+	  continue;
+
+	memcpy (pin_data[pin_num], p, MSC_SECTOR_SIZE);
+	pin_lba[pin_num++] = lba;
+      }
+}
+#else
+#define msc_pin_lookup(lba) ((const uint8_t *)NULL)
+#define msc_pin_drop(lba, count)
+#endif
+
+/*
+ * called with holding the lock.  Wake the MSC thread waiting for a
+ * command, so that it does something before waiting again.
+ */
+static void
+msc_rearm (void)
+{
+  if (msc_state != MSC_IDLE)
+    return;
+
+#ifdef FRAUCHEKY_UAS
+  if (msc_uas)
+    /* Command IUs are queued, nothing is lost.  */
+    chopstx_cond_signal (&msc_cond);
   else
+#endif
+  if (msg != RDY_OK)
     {
-      set_scsi_sense_data (0x02, 0x3a); /* NOT_READY */
-      keep_contingent_allegiance = 1;
+      msg = RDY_RESUME;
+      chopstx_cond_signal (&msc_cond);
     }
+}
+
+/*
+ * called with holding the lock, by EP6_IN_Callback.  Start to send
+ * next sector of READ(10), if it's available without blocking.
+ */
+static int
+msc_read_chain (void)
+{
+  const uint8_t *p;
+
+  if (!MEDIA_AVAILABLE ())
+    return -1;
+  if ((p = msc_pin_lookup (read_chain_lba)) == NULL
+      && (medium->lookup == NULL || (*medium->lookup) (read_chain_lba, &p)))
+    return -1;
+
+  read_chain_lba++;
+  read_chain_count--;
+  read_chain_sent++;
+  usb_start_transmit (p, MSC_SECTOR_SIZE);
+  return 0;
+}
+
+/*
+ * Change the medium to M (NULL means no medium), and let the host
+ * know by UNIT ATTENTION (or NOT READY).  It should be called after the MSC thread
+ * started.  The old medium should be kept valid, since a command in
+ * flight may still access it.  It returns the generation number of
+ * the medium.
+ */
+uint32_t
+msc_media_swap (const struct msc_medium *m)
+{
+  uint32_t generation;
+
+  chopstx_mutex_lock (&msc_mutex);
+
+  msc_medium = m;
+  generation = ++msc_media_generation;
+  medium_stopped = 0;
+  if (m != NULL && m->nblocks != 0)
+    /* NOT READY TO READY CHANGE, MEDIUM MAY HAVE CHANGED */
+    sense_queue_put (0x06, 0x28, 0x00, 0, 0);
+#ifdef MSC_CDROM
+  /* NewMedia, or MediaRemoval */
+  mmc_media_event = (m != NULL && m->nblocks != 0) ? 0x02 : 0x03;
+#endif
+#if MSC_MOUNT_PROFILE
+  msc_mount_profile_len = 0;
+  mount_commands = 0;
+#endif
+#if MSC_PIN_SECTORS
+  /* Sectors of the old medium are no longer valid.  */
+  pin_num = 0;
+  pin_stage_pending = 1;
+  msc_rearm ();
+#endif
 
   chopstx_mutex_unlock (&msc_mutex);
+  return generation;
 }
 
 
 static uint8_t scsi_read_format_capacities (uint32_t *nblocks,
 					    uint32_t *secsize)
 {
-  *nblocks = number_of_blocks;
+  *nblocks = MEDIA_AVAILABLE () ? medium->nblocks : 0;
   *secsize = MSC_SECTOR_SIZE;
   if (MEDIA_AVAILABLE ())
     return 2; /* Formatted Media.*/
@@ -296,292 +831,1768 @@ static struct CBW CBW;
 static struct CSW CSW;
 
 
-/* called with holding the lock.  */
-static int msc_recv_data (void)
+static void
+msc_slice_start (void)
 {
-  msc_state = MSC_DATA_OUT;
-  usb_start_receive (buf, 512);
-  chopstx_cond_wait (&msc_cond, &msc_mutex);
-  return 0;
+  slice_sectors = 0;
+  if (p_msc_clock)
+    slice_start = (*p_msc_clock) ();
 }
 
 /* called with holding the lock.  */
-static void msc_send_data (const uint8_t *p, size_t n)
+static void
+msc_slice_check (void)
 {
-  msc_state = MSC_DATA_IN;
-  usb_start_transmit (p, n);
-  chopstx_cond_wait (&msc_cond, &msc_mutex);
-  CSW.dCSWDataResidue -= (uint32_t)n;
+  int expired = 0;
+
+#if MSC_SLICE_SECTORS
+  if (++slice_sectors >= MSC_SLICE_SECTORS)
+    expired = 1;
+#endif
+
+  if (p_msc_clock && msc_slice_budget
+      && (*p_msc_clock) () - slice_start >= msc_slice_budget)
+    expired = 1;
+
+  if (expired)
+    {
+      chopstx_prio_t prio;
+      uint32_t run;
+
+      if (p_msc_clock)
+	{
+	  run = (*p_msc_clock) () - run_start;
+	  if (run > msc_latency_max)
+	    msc_latency_max = run;
+	}
+
+      chopstx_mutex_unlock (&msc_mutex);
+      prio = chopstx_setpriority (PRIO_MSC_SLICE);
+      if (MSC_SLICE_WAIT_USEC)
+	chopstx_usec_wait (MSC_SLICE_WAIT_USEC);
+      chopstx_setpriority (prio);
+      chopstx_mutex_lock (&msc_mutex);
+      /* Time of others is not of the MSC thread.  */
+      if (p_msc_clock)
+	run_start = (*p_msc_clock) ();
+      msc_slice_start ();
+    }
 }
 
 /* called with holding the lock.  */
-static void msc_send_result (const uint8_t *p, size_t n)
+static void msc_wait (void)
 {
-  if (p != NULL)
-    {
-      if (n > CBW.dCBWDataTransferLength)
-	n = CBW.dCBWDataTransferLength;
+  uint32_t run;
 
-      CSW.dCSWDataResidue = CBW.dCBWDataTransferLength;
-      msc_send_data (p, n);
-      CSW.bCSWStatus = MSC_CSW_STATUS_PASSED;
+  if (p_msc_clock)
+    {
+      run = (*p_msc_clock) () - run_start;
+      if (run > msc_latency_max)
+	msc_latency_max = run;
     }
 
-  CSW.dCSWSignature = MSC_CSW_SIGNATURE;
-
-  msc_state = MSC_SENDING_CSW;
-  usb_start_transmit ((uint8_t *)&CSW, sizeof CSW);
   chopstx_cond_wait (&msc_cond, &msc_mutex);
+
+  if (p_msc_clock)
+    run_start = (*p_msc_clock) ();
 }
 
 
+#ifdef FRAUCHEKY_UAS
+/* called with holding the lock.  */
 static void
-msc_handle_command (void)
+uas_send_iu (const uint8_t *p, size_t n)
 {
-  size_t n;
-  uint32_t nblocks, secsize;
-  uint32_t lba;
-  int r;
+  uint8_t state = msc_state;
 
-  chopstx_mutex_lock (&msc_mutex);
-  msc_state = MSC_IDLE;
-  msg = RDY_RESET;
-  usb_start_receive ((uint8_t *)&CBW, sizeof CBW);
-  chopstx_cond_wait (&msc_cond, &msc_mutex);
+  msc_state = MSC_SENDING_CSW;
+  usb_lld_write (FRAUCHEKY_UAS_ENDP, p, n);
+  msc_wait ();
+  msc_state = state;
+}
 
-  if (msg != RDY_OK)
+/* called with holding the lock.  */
+static void
+uas_send_ready (uint8_t iu_id)
+{
+  static uint8_t ready[4];
+
+  ready[0] = iu_id;
+  ready[1] = 0;
+  ready[2] = CSW.dCSWTag >> 8;
+  ready[3] = CSW.dCSWTag;
+  uas_ready = 1;
+  uas_send_iu (ready, sizeof ready);
+}
+#endif
+
+/* called with holding the lock.  */
+static int msc_recv_data (size_t n)
+{
+#ifdef FRAUCHEKY_UAS
+  if (msc_uas && !uas_ready)
+    uas_send_ready (UAS_IU_WRITE_READY);
+#endif
+  msc_state = MSC_DATA_OUT;
+  usb_start_receive (buf, n);
+  msc_wait ();
+  return 0;
+}
+
+/* called with holding the lock.  */
+static void msc_send_data (const uint8_t *p, size_t n)
+{
+#ifdef FRAUCHEKY_UAS
+  if (msc_uas && !uas_ready)
+    uas_send_ready (UAS_IU_READ_READY);
+#endif
+  msc_state = MSC_DATA_IN;
+  usb_start_transmit (p, n);
+  msc_wait ();
+  CSW.dCSWDataResidue -= (uint32_t)n;
+}
+
+/* called with holding the lock.  The first status after resume.  */
+static void
+msc_resume_done (void)
+{
+  uint32_t latency;
+
+  resume_pending = 0;
+  if (p_msc_clock)
+    {
+      latency = (*p_msc_clock) () - resume_start;
+      msc_resume_latency = latency;
+      if (latency > msc_resume_latency_max)
+	msc_resume_latency_max = latency;
+    }
+}
+
+/* called with holding the lock.  */
+static void msc_send_result (const uint8_t *p, size_t n)
+{
+  if (p != NULL)
+    {
+      if (n > CBW.dCBWDataTransferLength)
+	n = CBW.dCBWDataTransferLength;
+
+      CSW.dCSWDataResidue = CBW.dCBWDataTransferLength;
+#ifdef FRAUCHEKY_UAS
+      if (msc_uas)
+	{
+	  /* Short transfer ends by a short packet.  */
+	  if (n != 0)
+	    msc_send_data (p, n);
+	  if (n != 0 && n < CBW.dCBWDataTransferLength
+	      && (n % ENDP_MAX_SIZE) == 0)
+	    msc_send_data (p, 0);
+	}
+      else
+#endif
+      msc_send_data (p, n);
+      CSW.bCSWStatus = MSC_CSW_STATUS_PASSED;
+    }
+
+#ifdef FRAUCHEKY_UAS
+  if (msc_uas)
+    uas_send_status ();
+  else
+#endif
+    {
+      CSW.dCSWSignature = MSC_CSW_SIGNATURE;
+
+      msc_state = MSC_SENDING_CSW;
+      usb_start_transmit ((uint8_t *)&CSW, sizeof CSW);
+      msc_wait ();
+    }
+
+  if (resume_pending)
+    msc_resume_done ();
+}
+
+
+/*
+ * Requests to asynchronous backend.  A request is submitted again
+ * after its sector has been sent, so, MSC_ASYNC_WINDOW requests are
+ * enough.
+ */
+#if MSC_ASYNC_WINDOW < 1
+#error "MSC_ASYNC_WINDOW should be 1 or more"
+#endif
+static struct msc_request msc_requests[MSC_ASYNC_WINDOW];
+static uint8_t msc_requests_inflight;
+
+/* called by the thread of the backend.  */
+static void
+msc_request_complete (struct msc_request *req)
+{
+  chopstx_mutex_lock (&msc_mutex);
+  req->done = 1;
+  msc_requests_inflight--;
+  chopstx_cond_signal (&msc_request_cond);
+  chopstx_mutex_unlock (&msc_mutex);
+}
+
+/* called with holding the lock.  */
+static void
+msc_request_submit (struct msc_request *req, uint32_t lba)
+{
+  int r;
+
+  req->next = NULL;
+  req->lba = lba;
+  req->sector = NULL;
+  req->status = 0;
+  req->complete = msc_request_complete;
+  req->done = 0;
+
+  if ((req->sector = msc_pin_lookup (lba)) != NULL)
+    {
+      req->done = 1;
+      return;
+    }
+
+  msc_requests_inflight++;
+  r = (*medium->submit) (req);
+  if (r)
+    {
+      msc_requests_inflight--;
+      req->status = r;
+      req->done = 1;
+    }
+}
+
+/* called with holding the lock.  Wait REQ, or all when it's NULL.  */
+static void
+msc_request_wait (struct msc_request *req)
+{
+  while (req != NULL ? !req->done : msc_requests_inflight != 0)
+    chopstx_cond_wait (&msc_request_cond, &msc_mutex);
+}
+
+
+/*
+ * Command dispatch.
+ *
+ * The operation code of a command is mapped by scsi_command_index to
+ * an entry of scsi_commands, which records the handler, the expected
+ * direction of data, and the expected length of data.  Index 0 is
+ * for unknown commands, which looks up the commands registered by the
+ * application.
+ *
+ * Handlers are called with holding the lock.
+ */
+#define MSC_LEN_BLOCKS 0xff	/* Length by TRANSFER LENGTH in CDB.  */
+
+struct scsi_command {
+  void (*handler) (void);
+  uint8_t dir;			/* MSC_DIR_NONE, MSC_DIR_IN or MSC_DIR_OUT */
+  uint8_t len;			/* Maximum length of data in bytes */
+};
+
+#ifndef MSC_USER_COMMANDS
+#define MSC_USER_COMMANDS 4
+#endif
+
+struct msc_user_command {
+  msc_command_handler_t handler;
+  uint8_t opcode;
+  uint8_t dir;
+};
+
+static struct msc_user_command msc_user_commands[MSC_USER_COMMANDS];
+
+/* called with holding the lock.  */
+static void
+msc_check_condition (uint8_t sense_key, uint8_t asc)
+{
+  msc_set_sense (sense_key, asc, 0x00, 0, 0);
+}
+
+/* called with holding the lock.  */
+static void
+msc_not_ready (void)
+{
+  if (MEDIA_PRESENT ())
+    /* LOGICAL UNIT NOT READY, INITIALIZING COMMAND REQUIRED */
+    msc_set_sense (SCSI_ERROR_NOT_READY, 0x04, 0x02, 0, 0);
+  else
+    /* MEDIUM NOT PRESENT */
+    msc_set_sense (SCSI_ERROR_NOT_READY, 0x3a, 0x00, 0, 0);
+}
+
+/* called with holding the lock.  Error R of the backend at LBA.  */
+static void
+msc_scsi_error (int r, uint32_t lba)
+{
+  CSW.bCSWStatus = MSC_CSW_STATUS_FAILED;
+  if (r == SCSI_ERROR_NOT_READY)
+    msc_not_ready ();
+  else if (r == SCSI_ERROR_MEDIUM_ERROR)
+    /* UNRECOVERED READ ERROR */
+    msc_set_sense (r, 0x11, 0x00, SENSE_INFO, lba);
+  else if (r == SCSI_ERROR_MISCOMPARE)
+    msc_check_condition (r, 0x1d); /* MISCOMPARE DURING VERIFY */
+  else if (r == SCSI_ERROR_DATA_PROTECT)
+    msc_check_condition (r, 0x27); /* WRITE PROTECTED */
+  else if (r == SCSI_ERROR_ILLEAGAL_REQUEST)
+    /* LOGICAL BLOCK ADDRESS OUT OF RANGE */
+    msc_set_sense (r, 0x21, 0x00, SENSE_INFO, lba);
+  else
+    msc_set_sense (r, 0x00, 0x00, SENSE_INFO, lba);
+}
+
+/* called with holding the lock.  */
+static void
+msc_send_status (uint8_t status, uint32_t residue)
+{
+  CSW.bCSWStatus = status;
+  CSW.dCSWDataResidue = residue;
+  msc_send_result (NULL, 0);
+}
+
+/* called with holding the lock.  */
+static void
+msc_phase_error (void)
+{
+#ifdef FRAUCHEKY_UAS
+  if (msc_uas)
+    {
+      /* Length of data is by the CDB, wrong one is in the CDB.  */
+      msc_check_condition (0x05, 0x24); /* INVALID FIELD IN CDB */
+      msc_send_status (MSC_CSW_STATUS_FAILED, 0);
+      return;
+    }
+#endif
+
+  if (CBW.dCBWDataTransferLength == 0)
+    msc_send_status (MSC_CSW_STATUS_PHASE_ERROR, 0);
+  else
+    {
+      msc_state = MSC_ERROR;
+      if (CBW.bmCBWFlags & 0x80)
+	usb_lld_stall_tx (FRAUCHEKY_ENDP);
+      else
+	usb_lld_stall_rx (FRAUCHEKY_ENDP);
+    }
+}
+
+static void
+scsi_report_lun (void)
+{
+  buf[0]  = buf[1] = buf[2] = buf[3] = 0;
+  buf[4]  = buf[5] = buf[6] = buf[7] = 0;
+  msc_send_result (buf, 8);
+}
+
+static void
+put_be32 (uint8_t *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint32_t
+get_be32 (const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Build sense data of SENSE into P, by descriptor format if DESC.  */
+static size_t
+msc_build_sense (uint8_t *p, int desc)
+{
+  size_t len;
+
+  if (desc)
+    {
+      len = SENSE_DESC_LENGTH;
+      memset (p, 0, SENSE_DESC_LENGTH + SENSE_DESC_INFO_LENGTH);
+      p[0] = (sense.flags & SENSE_DEFERRED) ? 0x73 : 0x72;
+      p[1] = sense.key;
+      p[2] = sense.asc;
+      p[3] = sense.ascq;
+      if ((sense.flags & SENSE_INFO))
+	{
+	  p[7] = SENSE_DESC_INFO_LENGTH; /* Additional Sense Length */
+	  p[8] = 0x00;			/* Information */
+	  p[9] = 0x0a;
+	  p[10] = 0x80;			/* VALID */
+	  put_be32 (p + 16, sense.info);
+	  len += SENSE_DESC_INFO_LENGTH;
+	}
+    }
+  else
+    {
+      len = SENSE_FIXED_LENGTH;
+      memset (p, 0, SENSE_FIXED_LENGTH);
+      p[0] = (sense.flags & SENSE_DEFERRED) ? 0x71 : 0x70;
+      if ((sense.flags & SENSE_INFO))
+	{
+	  p[0] |= 0x80;			/* VALID */
+	  put_be32 (p + 3, sense.info);
+	}
+      p[2] = sense.key;
+      p[7] = 0x0a;			/* Additional Sense Length */
+      p[12] = sense.asc;
+      p[13] = sense.ascq;
+    }
+
+  return len;
+}
+
+static void
+scsi_request_sense (void)
+{
+  size_t len;
+
+  if (sense.key == 0 && !sense_queue_get () && !MEDIA_AVAILABLE ())
+    msc_not_ready ();
+
+  len = msc_build_sense (buf, CBW.CBWCB[1] & 0x01); /* DESC */
+  msc_send_result (buf, len);
+  /* After the error is reported, clear it.  */
+  msc_set_sense (0x00, 0x00, 0x00, 0, 0);
+}
+
+/* VPD pages for logical block provisioning.  */
+static const uint8_t scsi_inquiry_data_00_lbp[] = {
+  0x00,
+  0x00,   /* page code 0x00 */
+  0x00,   /* page length MSB */
+  0x04,   /* page length LSB */
+  0x00, 0x83, 0xb0, 0xb2
+};
+
+static const uint8_t scsi_inquiry_data_b2[] = {
+  0x00,
+  0xb2,   /* page code 0xb2: Logical Block Provisioning */
+  0x00,   /* page length MSB */
+  0x04,   /* page length LSB */
+  0x00,   /* threshold exponent */
+  0xe4,   /* LBPU, LBPWS, LBPWS10, LBPRZ=1 (cleared by discard_zero) */
+  0x02,   /* provisioning type: thin provisioned */
+  0x00
+};
+
+#define UNMAP_DESCRIPTORS_MAX ((MSC_SECTOR_SIZE - 8) / 16)
+
+static void
+scsi_inquiry_b0 (void)
+{
+  memset (buf, 0, 64);
+  buf[1] = 0xb0;		/* Block Limits */
+  buf[3] = 0x3c;
+  buf[4] = 0x01;		/* WSNZ: zero blocks is not allowed */
+  put_be32 (buf + 20, 0xffffffff);  /* MAXIMUM UNMAP LBA COUNT */
+  put_be32 (buf + 24, UNMAP_DESCRIPTORS_MAX);
+  put_be32 (buf + 28, 1);	/* OPTIMAL UNMAP GRANULARITY */
+  put_be32 (buf + 40, medium->nblocks); /* MAXIMUM WRITE SAME LENGTH */
+  msc_send_result (buf, 64);
+}
+
+static void
+scsi_inquiry (void)
+{
+  if (CBW.CBWCB[1] & 0x01)
+    /* EVPD */
+    {
+      if (MEDIA_AVAILABLE () && medium->discard && CBW.CBWCB[2] == 0x00)
+	msc_send_result (scsi_inquiry_data_00_lbp,
+			 sizeof scsi_inquiry_data_00_lbp);
+      else if (MEDIA_AVAILABLE () && medium->discard && CBW.CBWCB[2] == 0xb0)
+	scsi_inquiry_b0 ();
+      else if (MEDIA_AVAILABLE () && medium->discard && CBW.CBWCB[2] == 0xb2)
+	{
+	  memcpy (buf, scsi_inquiry_data_b2, sizeof scsi_inquiry_data_b2);
+	  if (!medium->discard_zero)
+	    buf[5] &= ~0x04;	/* LBPRZ */
+	  msc_send_result (buf, sizeof scsi_inquiry_data_b2);
+	}
+      else if (CBW.CBWCB[2] == 0x83)
+	/* Handle the case Page Code 0x83 */
+	msc_send_result (scsi_inquiry_data_83, sizeof scsi_inquiry_data_83);
+      else
+	/* Otherwise, assume page 00 */
+	msc_send_result (scsi_inquiry_data_00, sizeof scsi_inquiry_data_00);
+    }
+  else
+    msc_send_result (scsi_inquiry_data, sizeof scsi_inquiry_data);
+}
+
+static void
+scsi_read_format_capacities_cmd (void)
+{
+  uint32_t nblocks, secsize;
+
+  buf[8]  = scsi_read_format_capacities (&nblocks, &secsize);
+  buf[0]  = buf[1] = buf[2] = 0;
+  buf[3]  = 8;
+  buf[4]  = (uint8_t)(nblocks >> 24);
+  buf[5]  = (uint8_t)(nblocks >> 16);
+  buf[6]  = (uint8_t)(nblocks >> 8);
+  buf[7]  = (uint8_t)(nblocks >> 0);
+  buf[9]  = (uint8_t)(secsize >> 16);
+  buf[10] = (uint8_t)(secsize >> 8);
+  buf[11] = (uint8_t)(secsize >> 0);
+  msc_send_result (buf, 12);
+}
+
+static void
+scsi_success (void)
+{
+  msc_send_status (MSC_CSW_STATUS_PASSED, CBW.dCBWDataTransferLength);
+}
+
+static void
+scsi_start_stop_unit (void)
+{
+  if (CBW.CBWCB[4] == 0x00 /* stop */
+      || CBW.CBWCB[4] == 0x02 /* eject */ || CBW.CBWCB[4] == 0x03 /* close */)
+    {
+      msc_scsi_stop (CBW.CBWCB[4]);
+      medium_stopped = 1;
+    }
+  else if (CBW.CBWCB[4] == 0x01) /* start */
+    medium_stopped = 0;
+  scsi_success ();
+}
+
+static void
+scsi_test_unit_ready (void)
+{
+  if (!MEDIA_AVAILABLE ())
+    {
+      msc_not_ready ();
+      msc_send_status (MSC_CSW_STATUS_FAILED, CBW.dCBWDataTransferLength);
+    }
+  else
+    scsi_success ();
+}
+
+static void
+scsi_mode_sense6 (void)
+{
+  buf[0] = 0x03;
+  buf[1] = buf[2] = buf[3] = 0;
+  msc_send_result (buf, 4);
+}
+
+static void
+scsi_read_capacity10 (void)
+{
+  uint32_t nblocks, secsize;
+
+  scsi_read_format_capacities (&nblocks, &secsize);
+  buf[0]  = (uint8_t)((nblocks - 1) >> 24);
+  buf[1]  = (uint8_t)((nblocks - 1) >> 16);
+  buf[2]  = (uint8_t)((nblocks - 1) >> 8);
+  buf[3]  = (uint8_t)((nblocks - 1) >> 0);
+  buf[4]  = (uint8_t)(secsize >> 24);
+  buf[5]  = (uint8_t)(secsize >> 16);
+  buf[6] = (uint8_t)(secsize >> 8);
+  buf[7] = (uint8_t)(secsize >> 0);
+  msc_send_result (buf, 8);
+}
+
+/*
+ * READ(10) by asynchronous requests.  While a sector is sent, the
+ * backend fetches the next sectors (up to MSC_ASYNC_WINDOW - 1).
+ */
+static void
+scsi_read10_async (uint32_t lba)
+{
+  uint32_t count = (CBW.CBWCB[7] << 8) | CBW.CBWCB[8];
+  uint32_t submitted, sent;
+  struct msc_request *req;
+  int r = 0;
+
+  for (submitted = 0; submitted < count && submitted < MSC_ASYNC_WINDOW;
+       submitted++)
+    msc_request_submit (&msc_requests[submitted], lba + submitted);
+
+  for (sent = 0; sent < count; sent++)
+    {
+      req = &msc_requests[sent % MSC_ASYNC_WINDOW];
+      msc_request_wait (req);
+      if ((r = req->status))
+	break;
+
+      msc_send_data (req->sector, MSC_SECTOR_SIZE);
+      if (submitted < count)
+	msc_request_submit (req, lba + submitted++);
+      msc_slice_check ();
+    }
+
+  /* Requests in flight should be finished, before reuse.  */
+  msc_request_wait (NULL);
+
+  if (r)
+    msc_scsi_error (r, lba + sent);
+  else
+    CSW.bCSWStatus = MSC_CSW_STATUS_PASSED;
+  msc_send_result (NULL, 0);
+}
+
+static void
+scsi_read10 (void)
+{
+  uint32_t lba, count;
+  const uint8_t *p;
+  int r;
+
+  lba = (CBW.CBWCB[2] << 24) | (CBW.CBWCB[3] << 16)
+      | (CBW.CBWCB[4] <<  8) | CBW.CBWCB[5];
+
+  count = (CBW.CBWCB[7] << 8) | CBW.CBWCB[8];
+  msc_mount_record (lba, count);
+
+  msc_state = MSC_DATA_IN;
+  CSW.dCSWDataResidue = CBW.dCBWDataTransferLength;
+  msc_slice_start ();
+
+  if (MEDIA_AVAILABLE () && medium->submit != NULL)
+    {
+      scsi_read10_async (lba);
+      return;
+    }
+
+  while (1)
+    {
+      if (count == 0)
+	{
+	  CSW.bCSWStatus = MSC_CSW_STATUS_PASSED;
+	  break;
+	}
+
+      if (!MEDIA_AVAILABLE ())
+	r = SCSI_ERROR_NOT_READY;
+      else if ((p = msc_pin_lookup (lba)) != NULL)
+	r = 0;
+      else
+	r = (*medium->read) (lba, &p);
+
+      if (r == 0)
+	{
+	  /* Following sectors may be sent by EP6_IN_Callback.  */
+	  read_chain_lba = lba + 1;
+	  read_chain_count = count - 1;
+	  read_chain_sent = 0;
+	  msc_send_data (p, MSC_SECTOR_SIZE);
+	  read_chain_count = 0;
+
+	  CSW.dCSWDataResidue -= read_chain_sent * MSC_SECTOR_SIZE;
+	  lba += 1 + read_chain_sent;
+	  count -= 1 + read_chain_sent;
+	  msc_slice_check ();
+	}
+      else
+	{
+	  msc_scsi_error (r, lba);
+	  break;
+	}
+    }
+
+  msc_send_result (NULL, 0);
+}
+
+static void
+scsi_write10 (void)
+{
+  uint32_t lba;
+  int r;
+
+  lba = (CBW.CBWCB[2] << 24) | (CBW.CBWCB[3] << 16)
+      | (CBW.CBWCB[4] <<  8) | CBW.CBWCB[5];
+
+  CSW.dCSWDataResidue = CBW.dCBWDataTransferLength;
+  msc_slice_start ();
+
+  while (1)
+    {
+      if (CBW.CBWCB[8] == 0 && CBW.CBWCB[7] == 0)
+	{
+	  CSW.bCSWStatus = MSC_CSW_STATUS_PASSED;
+	  break;
+	}
+
+      msc_recv_data (MSC_SECTOR_SIZE);
+      if (msg != RDY_OK)
+	/* ignore erroneous packet, ang go next.  */
+	continue;
+
+      CSW.dCSWDataResidue -= MSC_SECTOR_SIZE;
+      if (!MEDIA_AVAILABLE ())
+	r = SCSI_ERROR_NOT_READY;
+      else if (medium->write == NULL)
+	r = SCSI_ERROR_DATA_PROTECT;
+      else
+	{
+	  msc_pin_drop (lba, 1);
+	  r = (*medium->write) (lba, buf, MSC_SECTOR_SIZE);
+	}
+
+      if (r == 0)
+	{
+	  if (++CBW.CBWCB[5] == 0)
+	    if (++CBW.CBWCB[4] == 0)
+	      if (++CBW.CBWCB[3] == 0)
+		++CBW.CBWCB[2];
+	  if (CBW.CBWCB[8]-- == 0)
+	    CBW.CBWCB[7]--;
+	  lba++;
+	  msc_slice_check ();
+	}
+      else
+	{
+	  msc_scsi_error (r, lba);
+	  break;
+	}
+    }
+
+  msc_send_result (NULL, 0);
+}
+
+/*
+ * VERIFY(10) checks sectors by the verify method of the medium.  With BYTCHK, data
+ * from host is compared to the sector by CRC-32, since the buffer
+ * may be shared with the backend (MSC_MINIMAL_RAM).
+ */
+static void
+scsi_verify10 (void)
+{
+  uint32_t lba, crc, len;
+  const uint8_t *p;
+  int bytchk = (CBW.CBWCB[1] & SCSI_VERIFY10_BYTCHK);
+  int r;
+
+  len = ((CBW.CBWCB[7] << 8) | CBW.CBWCB[8]) * MSC_SECTOR_SIZE;
+  if (bytchk
+      && ((CBW.dCBWDataTransferLength != 0 && (CBW.bmCBWFlags & 0x80))
+	  || CBW.dCBWDataTransferLength < len))
+    {
+      msc_phase_error ();
+      return;
+    }
+
+  lba = (CBW.CBWCB[2] << 24) | (CBW.CBWCB[3] << 16)
+      | (CBW.CBWCB[4] <<  8) | CBW.CBWCB[5];
+
+  CSW.dCSWDataResidue = CBW.dCBWDataTransferLength;
+  msc_slice_start ();
+
+  while (1)
+    {
+      if (CBW.CBWCB[8] == 0 && CBW.CBWCB[7] == 0)
+	{
+	  CSW.bCSWStatus = MSC_CSW_STATUS_PASSED;
+	  break;
+	}
+
+      crc = 0;
+      if (bytchk)
+	{
+	  msc_recv_data (MSC_SECTOR_SIZE);
+	  if (msg != RDY_OK)
+	    /* ignore erroneous packet, ang go next.  */
+	    continue;
+	  crc = msc_crc32 (buf, MSC_SECTOR_SIZE);
+	  CSW.dCSWDataResidue -= MSC_SECTOR_SIZE;
+	}
+
+      if (!MEDIA_AVAILABLE ())
+	r = SCSI_ERROR_NOT_READY;
+      else if ((r = medium->verify ? (*medium->verify) (lba) : 0) == 0
+	       && bytchk)
+	{
+	  r = (*medium->read) (lba, &p);
+	  if (r == 0 && msc_crc32 (p, MSC_SECTOR_SIZE) != crc)
+	    r = SCSI_ERROR_MISCOMPARE;
+	}
+
+      if (r == 0)
+	{
+	  if (++CBW.CBWCB[5] == 0)
+	    if (++CBW.CBWCB[4] == 0)
+	      if (++CBW.CBWCB[3] == 0)
+		++CBW.CBWCB[2];
+	  if (CBW.CBWCB[8]-- == 0)
+	    CBW.CBWCB[7]--;
+	  lba++;
+	  msc_slice_check ();
+	}
+      else
+	{
+	  msc_scsi_error (r, lba);
+	  break;
+	}
+    }
+
+  msc_send_result (NULL, 0);
+}
+
+/* called with holding the lock.  */
+static void
+msc_fail (uint8_t sense_key, uint8_t asc, uint32_t residue)
+{
+  msc_check_condition (sense_key, asc);
+  msc_send_status (MSC_CSW_STATUS_FAILED, residue);
+}
+
+static void
+scsi_service_action_in16 (void)
+{
+  uint32_t nblocks, secsize;
+
+  if ((CBW.CBWCB[1] & 0x1f) != SCSI_SAI_READ_CAPACITY16)
+    {
+      msc_fail (0x05, 0x24, CBW.dCBWDataTransferLength); /* INVALID FIELD */
+      return;
+    }
+
+  scsi_read_format_capacities (&nblocks, &secsize);
+  memset (buf, 0, 32);
+  put_be32 (buf + 4, nblocks - 1);
+  put_be32 (buf + 8, secsize);
+  if (MEDIA_AVAILABLE () && medium->discard)
+    buf[14] = medium->discard_zero ? 0xc0 : 0x80; /* LBPME, LBPRZ */
+  msc_send_result (buf, 32);
+}
+
+#ifdef MSC_CDROM
+/*
+ * MMC commands for CD-ROM.  The medium is a single data track (of
+ * an ISO 9660 image), in a single session.
+ */
+/* called with holding the lock.  Truncated by ALLOCATION LENGTH.  */
+static void
+mmc_send_result (const uint8_t *p, size_t n)
+{
+  size_t alloc = (CBW.CBWCB[7] << 8) | CBW.CBWCB[8];
+
+  msc_send_result (p, n < alloc ? n : alloc);
+}
+
+static void
+mmc_put_address (uint8_t *p, uint32_t lba, int msf)
+{
+  if (msf)
+    {
+      lba += 150;
+      p[0] = 0;
+      p[1] = lba / (60 * 75);
+      p[2] = (lba / 75) % 60;
+      p[3] = lba % 75;
+    }
+  else
+    put_be32 (p, lba);
+}
+
+static void
+scsi_read_toc (void)
+{
+  int msf = CBW.CBWCB[1] & 0x02;
+  uint8_t format = CBW.CBWCB[2] & 0x0f;
+  uint8_t track = CBW.CBWCB[6];
+  uint8_t *p = buf + 4;
+
+  if (!MEDIA_AVAILABLE ())
+    {
+      msc_not_ready ();
+      msc_send_status (MSC_CSW_STATUS_FAILED, CBW.dCBWDataTransferLength);
+      return;
+    }
+
+  if ((format != 0 && format != 1)
+      || (format == 0 && track > 1 && track != 0xaa))
+    {
+      msc_fail (0x05, 0x24, CBW.dCBWDataTransferLength); /* INVALID FIELD */
+      return;
+    }
+
+  buf[2] = buf[3] = 1;		/* First and last (track or session) */
+  if (format == 0 && track != 0xaa)
+    {
+      p[0] = 0;
+      p[1] = 0x14;		/* ADR: Q sub-channel, CONTROL: data track */
+      p[2] = 1;
+      p[3] = 0;
+      mmc_put_address (p + 4, 0, msf);
+      p += 8;
+    }
+
+  p[0] = 0;
+  p[1] = 0x14;
+  p[2] = format == 0 ? 0xaa : 1; /* Lead-out, or the first track */
+  p[3] = 0;
+  mmc_put_address (p + 4, format == 0 ? medium->nblocks : 0, msf);
+  p += 8;
+
+  buf[0] = (p - buf - 2) >> 8;
+  buf[1] = p - buf - 2;
+  mmc_send_result (buf, p - buf);
+}
+
+#define MMC_PROFILE_CDROM 0x0008
+
+/*
+ * Features for GET CONFIGURATION: feature code, flags (version,
+ * persistent), and additional data.  Current bit is added when the
+ * media is available (or the feature is persistent).
+ */
+static const uint8_t mmc_features[] = {
+  0x00, 0x00, 0x02, 4,		/* Profile List */
+    MMC_PROFILE_CDROM >> 8, MMC_PROFILE_CDROM & 0xff, 0, 0,
+  0x00, 0x01, 0x06, 8,		/* Core: USB, DBE */
+    0, 0, 0, 0x08, 0x01, 0, 0, 0,
+  0x00, 0x02, 0x06, 4,		/* Morphing: OCEvent */
+    0x02, 0, 0, 0,
+  0x00, 0x03, 0x02, 4,		/* Removable Medium: tray, eject */
+    0x29, 0, 0, 0,
+  0x00, 0x10, 0x00, 8,		/* Random Readable */
+    0, 0, MSC_SECTOR_SIZE >> 8, MSC_SECTOR_SIZE & 0xff, 0, 1, 0, 0,
+  0x00, 0x1e, 0x00, 4,		/* CD Read */
+    0, 0, 0, 0,
+};
+
+static void
+scsi_get_configuration (void)
+{
+  uint8_t rt = CBW.CBWCB[1] & 0x03;
+  uint16_t start = (CBW.CBWCB[2] << 8) | CBW.CBWCB[3];
+  uint8_t *p = buf + 8;
+  const uint8_t *f;
+  uint16_t code;
+  int current;
+
+  if (rt == 3)
+    {
+      msc_fail (0x05, 0x24, CBW.dCBWDataTransferLength); /* INVALID FIELD */
+      return;
+    }
+
+  memset (buf, 0, 8);
+  if (MEDIA_AVAILABLE ())
+    buf[7] = MMC_PROFILE_CDROM;	/* Current profile */
+
+  for (f = mmc_features; f < mmc_features + sizeof mmc_features;
+       f += 4 + f[3])
+    {
+      code = (f[0] << 8) | f[1];
+      current = MEDIA_AVAILABLE () || (f[2] & 0x02);
+      if (code < start || (rt == 1 && !current) || (rt == 2 && code != start))
+	continue;
+
+      memcpy (p, f, 4 + f[3]);
+      if (current)
+	p[2] |= 0x01;
+      if (code == 0x0000 && MEDIA_AVAILABLE ())
+	p[6] = 0x01;		/* CurrentP of the profile */
+      p += 4 + f[3];
+    }
+
+  put_be32 (buf, p - buf - 4);
+  mmc_send_result (buf, p - buf);
+}
+
+static void
+scsi_get_event_status (void)
+{
+  if (!(CBW.CBWCB[1] & 0x01))
+    {
+      /* Asynchronous operation is not supported.  */
+      msc_fail (0x05, 0x24, CBW.dCBWDataTransferLength); /* INVALID FIELD */
+      return;
+    }
+
+  buf[3] = 0x10;		/* Supported: media class */
+  if (CBW.CBWCB[4] & 0x10)
+    {
+      buf[0] = 0;
+      buf[1] = 6;
+      buf[2] = 0x04;		/* Media class */
+      buf[4] = mmc_media_event;
+      buf[5] = MEDIA_AVAILABLE () ? 0x02 : 0x00; /* Media present */
+      buf[6] = buf[7] = 0;
+      mmc_media_event = 0;
+      mmc_send_result (buf, 8);
+    }
+  else
+    {
+      buf[0] = 0;
+      buf[1] = 2;
+      buf[2] = 0x80;		/* NEA: no event available */
+      mmc_send_result (buf, 4);
+    }
+}
+
+static void
+scsi_mode_sense10 (void)
+{
+  uint8_t page = CBW.CBWCB[2] & 0x3f;
+
+  if (page != 0x2a && page != 0x3f)
+    {
+      msc_fail (0x05, 0x24, CBW.dCBWDataTransferLength); /* INVALID FIELD */
+      return;
+    }
+
+  memset (buf, 0, 8 + 20);
+  buf[1] = 8 + 20 - 2;
+  buf[8] = 0x2a;		/* CD capabilities and mechanical status */
+  buf[9] = 20 - 2;
+  buf[14] = 0x29;		/* Tray, eject, lock */
+  mmc_send_result (buf, 8 + 20);
+}
+#endif
+
+/*
+ * Receive parameter data of LEN bytes for a command.  It returns -1
+ * on error (the pipe is stalled).
+ */
+static int
+msc_recv_param (uint32_t len)
+{
+  if (len == 0)
+    return 0;
+
+  if (len > CBW.dCBWDataTransferLength || (CBW.bmCBWFlags & 0x80)
+      || len > MSC_SECTOR_SIZE)
+    {
+      msc_phase_error ();
+      return -1;
+    }
+
+  msc_recv_data (len);
+  if (msg != RDY_OK || ep6_out.rxcnt != len)
+    {
+      msc_phase_error ();
+      return -1;
+    }
+
+  return 0;
+}
+
+/* UNMAP: block descriptors are in BUF.  */
+static void
+scsi_unmap (void)
+{
+  uint32_t len = (CBW.CBWCB[7] << 8) | CBW.CBWCB[8];
+  uint32_t residue, n, lba, count;
+  const uint8_t *d;
+  int r = 0;
+
+  if (msc_recv_param (len) < 0)
+    return;
+
+  residue = CBW.dCBWDataTransferLength - len;
+  if (!MEDIA_AVAILABLE ())
+    {
+      msc_fail (SCSI_ERROR_NOT_READY, 0x3a, residue);
+      return;
+    }
+
+  if (medium->discard == NULL)
+    {
+      msc_fail (0x05, 0x20, residue); /* INVALID COMMAND OPERATION CODE */
+      return;
+    }
+
+  n = len < 8 ? 0 : ((buf[2] << 8) | buf[3]);
+  if (n > len - 8)
+    {
+      msc_fail (0x05, 0x26, residue); /* INVALID FIELD IN PARAMETER LIST */
+      return;
+    }
+
+  for (d = buf + 8; d + 16 <= buf + 8 + n; d += 16)
+    {
+      lba = get_be32 (d + 4);
+      count = get_be32 (d + 8);
+      if (get_be32 (d) != 0 || lba > medium->nblocks
+	  || count > medium->nblocks - lba)
+	{
+	  msc_fail (0x05, 0x21, residue); /* LBA OUT OF RANGE */
+	  return;
+	}
+
+      msc_pin_drop (lba, count);
+      if (count && (r = (*medium->discard) (lba, count)) != 0)
+	break;
+    }
+
+  if (r)
+    {
+      msc_scsi_error (r, lba);
+      CSW.dCSWDataResidue = residue;
+      msc_send_result (NULL, 0);
+    }
+  else
+    msc_send_status (MSC_CSW_STATUS_PASSED, residue);
+}
+
+/*
+ * WRITE SAME(10) and WRITE SAME(16).  With UNMAP bit and the data of
+ * zeros, the sectors are discarded, when they read as zeros after
+ * that.  Otherwise, the data is written to each sector.
+ */
+static void
+scsi_write_same (void)
+{
+  uint32_t lba, count, residue, i;
+  int unmap = (CBW.CBWCB[1] & 0x08);
+  int zero = 1;
+  int r = 0;
+
+  if (CBW.CBWCB[0] == SCSI_WRITE_SAME16)
+    {
+      lba = get_be32 (CBW.CBWCB + 6);
+      count = get_be32 (CBW.CBWCB + 10);
+    }
+  else
+    {
+      lba = get_be32 (CBW.CBWCB + 2);
+      count = (CBW.CBWCB[7] << 8) | CBW.CBWCB[8];
+    }
+
+  if (CBW.dCBWDataTransferLength < MSC_SECTOR_SIZE)
+    {
+      msc_phase_error ();
+      return;
+    }
+
+  if (msc_recv_param (MSC_SECTOR_SIZE) < 0)
+    return;
+
+  residue = CBW.dCBWDataTransferLength - MSC_SECTOR_SIZE;
+  if (!MEDIA_AVAILABLE ())
+    {
+      msc_fail (SCSI_ERROR_NOT_READY, 0x3a, residue);
+      return;
+    }
+
+  if (count == 0 || (unmap && medium->discard == NULL))
+    {
+      msc_fail (0x05, 0x24, residue); /* INVALID FIELD IN CDB */
+      return;
+    }
+
+  if ((CBW.CBWCB[0] == SCSI_WRITE_SAME16 && get_be32 (CBW.CBWCB + 2) != 0)
+      || lba >= medium->nblocks || count > medium->nblocks - lba)
+    {
+      msc_fail (0x05, 0x21, residue); /* LBA OUT OF RANGE */
+      return;
+    }
+
+  for (i = 0; i < MSC_SECTOR_SIZE; i++)
+    if (buf[i])
+      {
+	zero = 0;
+	break;
+      }
+
+  msc_pin_drop (lba, count);
+  i = 0;
+  if (unmap && zero && medium->discard_zero)
+    r = (*medium->discard) (lba, count);
+  else if (medium->write == NULL)
+    r = SCSI_ERROR_DATA_PROTECT;
+  else
+    {
+      msc_slice_start ();
+      for (i = 0; i < count; i++)
+	{
+	  r = (*medium->write) (lba + i, buf, MSC_SECTOR_SIZE);
+	  if (r)
+	    break;
+	  msc_slice_check ();
+	}
+    }
+
+  if (r)
     {
-      /* Error occured, ignore the request and go into error state */
-      msc_state = MSC_ERROR;
-      usb_lld_stall_rx (ENDP6);
-      goto done; 
+      msc_scsi_error (r, lba + i);
+      CSW.dCSWDataResidue = residue;
+      msc_send_result (NULL, 0);
     }
+  else
+    msc_send_status (MSC_CSW_STATUS_PASSED, residue);
+}
 
-  n = ep6_out.rxcnt;
+/* called with holding the lock.  */
+static void
+msc_user_command (struct msc_user_command *c)
+{
+  uint32_t len = CBW.dCBWDataTransferLength;
+  size_t n = 0;
+  int r;
 
-  if ((n != sizeof (struct CBW)) || (CBW.dCBWSignature != MSC_CBW_SIGNATURE))
+  if (c->dir == MSC_DIR_OUT && len > MSC_SECTOR_SIZE)
+    {
+      /* Data which can't be received would be left in the transport.  */
+      msc_phase_error ();
+      return;
+    }
+  else if (c->dir == MSC_DIR_IN && len > MSC_SECTOR_SIZE)
+    len = MSC_SECTOR_SIZE;
+
+  if (c->dir == MSC_DIR_OUT && len != 0)
+    {
+      msc_recv_data (len);
+      if (msg != RDY_OK)
+	{
+	  msc_phase_error ();
+	  return;
+	}
+      n = ep6_out.rxcnt;
+    }
+
+  r = (*c->handler) (CBW.CBWCB, buf, &n);
+  if (r)
+    {
+      msc_check_condition (r & 0xff, r >> 8);
+      msc_send_status (MSC_CSW_STATUS_FAILED, CBW.dCBWDataTransferLength - n);
+    }
+  else if (c->dir == MSC_DIR_IN && n != 0)
+    msc_send_result (buf, n);
+  else
+    msc_send_status (MSC_CSW_STATUS_PASSED, CBW.dCBWDataTransferLength - n);
+}
+
+static void
+scsi_unknown (void)
+{
+  int i;
+
+  for (i = 0; i < MSC_USER_COMMANDS; i++)
+    {
+      struct msc_user_command *c = &msc_user_commands[i];
+
+      if (c->handler == NULL || c->opcode != CBW.CBWCB[0])
+	continue;
+
+      if (CBW.dCBWDataTransferLength != 0
+	  && ((c->dir == MSC_DIR_IN && !(CBW.bmCBWFlags & 0x80))
+	      || (c->dir == MSC_DIR_OUT && (CBW.bmCBWFlags & 0x80))))
+	msc_phase_error ();
+      else
+	msc_user_command (c);
+      return;
+    }
+
+  msc_check_condition (0x05, 0x20); /* INVALID COMMAND OPERATION CODE */
+
+  if (CBW.dCBWDataTransferLength == 0)
+    msc_send_status (MSC_CSW_STATUS_FAILED, 0);
+  else
     {
       msc_state = MSC_ERROR;
-      usb_lld_stall_rx (ENDP6);
-      goto done;
+      usb_lld_stall_tx (FRAUCHEKY_ENDP);
     }
+}
 
-  CSW.dCSWTag = CBW.dCBWTag;
-  switch (CBW.CBWCB[0]) {
-  case SCSI_REPORT_LUN:
-    buf[0]  = buf[1] = buf[2] = buf[3] = 0;
-    buf[4]  = buf[5] = buf[6] = buf[7] = 0;
-    msc_send_result (buf, 8);
-    goto done;
-  case SCSI_REQUEST_SENSE:
-    if (CBW.CBWCB[1] & 0x01) /* DESC */
-      msc_send_result (scsi_sense_data_desc, sizeof scsi_sense_data_desc);
-    else
-      msc_send_result (scsi_sense_data_fixed, sizeof scsi_sense_data_fixed);
-    /* After the error is reported, clear it, if it's .  */
-    if (!keep_contingent_allegiance)
-      {
-	contingent_allegiance = 0;
-	set_scsi_sense_data (0x00, 0x00);
-      }
-    goto done;
-  case SCSI_INQUIRY:
-    if (CBW.CBWCB[1] & 0x01)
-      /* EVPD */
-      {
-	if (CBW.CBWCB[2] == 0x83)
-	  /* Handle the case Page Code 0x83 */
-	  msc_send_result (scsi_inquiry_data_83, sizeof scsi_inquiry_data_83);
-	else
-	  /* Otherwise, assume page 00 */
-	  msc_send_result (scsi_inquiry_data_00, sizeof scsi_inquiry_data_00);
-      }
-    else
-      msc_send_result (scsi_inquiry_data, sizeof scsi_inquiry_data);
-    goto done;
-  case SCSI_READ_FORMAT_CAPACITIES:
-    buf[8]  = scsi_read_format_capacities (&nblocks, &secsize);
-    buf[0]  = buf[1] = buf[2] = 0;
-    buf[3]  = 8;
-    buf[4]  = (uint8_t)(nblocks >> 24);
-    buf[5]  = (uint8_t)(nblocks >> 16);
-    buf[6]  = (uint8_t)(nblocks >> 8);
-    buf[7]  = (uint8_t)(nblocks >> 0);
-    buf[9]  = (uint8_t)(secsize >> 16);
-    buf[10] = (uint8_t)(secsize >> 8);
-    buf[11] = (uint8_t)(secsize >> 0);
-    msc_send_result (buf, 12);
-    goto done;
-  case SCSI_START_STOP_UNIT:
-    if (CBW.CBWCB[4] == 0x00 /* stop */
-	|| CBW.CBWCB[4] == 0x02 /* eject */ || CBW.CBWCB[4] == 0x03 /* close */)
-      {
-	msc_scsi_stop (CBW.CBWCB[4]);
-	set_scsi_sense_data (0x05, 0x24); /* ILLEGAL_REQUEST */
-	contingent_allegiance = 1;
-	keep_contingent_allegiance = 1;
-      }
-    /* CBW.CBWCB[4] == 0x01 *//* start */
-    goto success;
-  case SCSI_TEST_UNIT_READY:
-    if (contingent_allegiance)
-      {
-	CSW.bCSWStatus = MSC_CSW_STATUS_FAILED;
-	CSW.dCSWDataResidue = 0;
-	msc_send_result (NULL, 0);
-	goto done;
-      }
-    /* fall through */
-  success:
-  case SCSI_SYNCHRONIZE_CACHE:
-  case SCSI_VERIFY10:
-  case SCSI_ALLOW_MEDIUM_REMOVAL:
-    CSW.bCSWStatus = MSC_CSW_STATUS_PASSED;
-    CSW.dCSWDataResidue = CBW.dCBWDataTransferLength;
-    msc_send_result (NULL, 0);
-    goto done;
-  case SCSI_MODE_SENSE6:
-  case SCSI_ATA_16:
-    buf[0] = 0x03;
-    buf[1] = buf[2] = buf[3] = 0;
-    msc_send_result (buf, 4);
-    goto done;
-  case SCSI_READ_CAPACITY10:
-    scsi_read_format_capacities (&nblocks, &secsize);
-    buf[0]  = (uint8_t)((nblocks - 1) >> 24);
-    buf[1]  = (uint8_t)((nblocks - 1) >> 16);
-    buf[2]  = (uint8_t)((nblocks - 1) >> 8);
-    buf[3]  = (uint8_t)((nblocks - 1) >> 0);
-    buf[4]  = (uint8_t)(secsize >> 24);
-    buf[5]  = (uint8_t)(secsize >> 16);
-    buf[6] = (uint8_t)(secsize >> 8);
-    buf[7] = (uint8_t)(secsize >> 0);
-    msc_send_result (buf, 8);
-    goto done;
-  case SCSI_READ10:
-  case SCSI_WRITE10:
-    break;
-  default:
-    if (CBW.dCBWDataTransferLength == 0)
-      {
-	CSW.bCSWStatus = MSC_CSW_STATUS_FAILED;
-	CSW.dCSWDataResidue = 0;
-	msc_send_result (NULL, 0);
-	goto done;
-      }
-    else
+enum {
+  CMD_UNKNOWN = 0,
+  CMD_TEST_UNIT_READY,
+  CMD_REQUEST_SENSE,
+  CMD_INQUIRY,
+  CMD_MODE_SENSE6,
+  CMD_START_STOP_UNIT,
+  CMD_ALLOW_MEDIUM_REMOVAL,
+  CMD_READ_FORMAT_CAPACITIES,
+  CMD_READ_CAPACITY10,
+  CMD_READ10,
+  CMD_WRITE10,
+  CMD_VERIFY10,
+  CMD_SYNCHRONIZE_CACHE,
+  CMD_ATA_16,
+  CMD_REPORT_LUN,
+  CMD_WRITE_SAME10,
+  CMD_UNMAP,
+  CMD_WRITE_SAME16,
+  CMD_SERVICE_ACTION_IN16,
+#ifdef MSC_CDROM
+  CMD_READ_TOC,
+  CMD_GET_CONFIGURATION,
+  CMD_GET_EVENT_STATUS,
+  CMD_MODE_SENSE10,
+#endif
+};
+
+static const struct scsi_command scsi_commands[] = {
+  [CMD_UNKNOWN]                = { scsi_unknown, MSC_DIR_NONE, 0 },
+  [CMD_TEST_UNIT_READY]        = { scsi_test_unit_ready, MSC_DIR_NONE, 0 },
+  [CMD_REQUEST_SENSE]          = { scsi_request_sense, MSC_DIR_IN,
+				   SENSE_DESC_LENGTH + SENSE_DESC_INFO_LENGTH },
+  [CMD_INQUIRY]                = { scsi_inquiry, MSC_DIR_IN,
+				   sizeof scsi_inquiry_data },
+  [CMD_MODE_SENSE6]            = { scsi_mode_sense6, MSC_DIR_IN, 4 },
+  [CMD_START_STOP_UNIT]        = { scsi_start_stop_unit, MSC_DIR_NONE, 0 },
+  [CMD_ALLOW_MEDIUM_REMOVAL]   = { scsi_success, MSC_DIR_NONE, 0 },
+  [CMD_READ_FORMAT_CAPACITIES] = { scsi_read_format_capacities_cmd,
+				   MSC_DIR_IN, 12 },
+  [CMD_READ_CAPACITY10]        = { scsi_read_capacity10, MSC_DIR_IN, 8 },
+  [CMD_READ10]                 = { scsi_read10, MSC_DIR_IN, MSC_LEN_BLOCKS },
+  [CMD_WRITE10]                = { scsi_write10, MSC_DIR_OUT, MSC_LEN_BLOCKS },
+  [CMD_VERIFY10]               = { scsi_verify10, MSC_DIR_NONE, 0 },
+  [CMD_SYNCHRONIZE_CACHE]      = { scsi_success, MSC_DIR_NONE, 0 },
+  [CMD_ATA_16]                 = { scsi_mode_sense6, MSC_DIR_IN, 4 },
+  [CMD_REPORT_LUN]             = { scsi_report_lun, MSC_DIR_IN, 8 },
+  [CMD_WRITE_SAME10]           = { scsi_write_same, MSC_DIR_OUT, 0 },
+  [CMD_UNMAP]                  = { scsi_unmap, MSC_DIR_OUT, 0 },
+  [CMD_WRITE_SAME16]           = { scsi_write_same, MSC_DIR_OUT, 0 },
+  [CMD_SERVICE_ACTION_IN16]    = { scsi_service_action_in16, MSC_DIR_IN, 32 },
+#ifdef MSC_CDROM
+  [CMD_READ_TOC]               = { scsi_read_toc, MSC_DIR_IN, 20 },
+  [CMD_GET_CONFIGURATION]      = { scsi_get_configuration, MSC_DIR_IN,
+				   8 + sizeof mmc_features },
+  [CMD_GET_EVENT_STATUS]       = { scsi_get_event_status, MSC_DIR_IN, 8 },
+  [CMD_MODE_SENSE10]           = { scsi_mode_sense10, MSC_DIR_IN, 8 + 20 },
+#endif
+};
+
+static const uint8_t scsi_command_index[256] = {
+  [SCSI_TEST_UNIT_READY]        = CMD_TEST_UNIT_READY,
+  [SCSI_REQUEST_SENSE]          = CMD_REQUEST_SENSE,
+  [SCSI_INQUIRY]                = CMD_INQUIRY,
+  [SCSI_MODE_SENSE6]            = CMD_MODE_SENSE6,
+  [SCSI_START_STOP_UNIT]        = CMD_START_STOP_UNIT,
+  [SCSI_ALLOW_MEDIUM_REMOVAL]   = CMD_ALLOW_MEDIUM_REMOVAL,
+  [SCSI_READ_FORMAT_CAPACITIES] = CMD_READ_FORMAT_CAPACITIES,
+  [SCSI_READ_CAPACITY10]        = CMD_READ_CAPACITY10,
+  [SCSI_READ10]                 = CMD_READ10,
+  [SCSI_WRITE10]                = CMD_WRITE10,
+  [SCSI_VERIFY10]               = CMD_VERIFY10,
+  [SCSI_SYNCHRONIZE_CACHE]      = CMD_SYNCHRONIZE_CACHE,
+  [SCSI_ATA_16]                 = CMD_ATA_16,
+  [SCSI_REPORT_LUN]             = CMD_REPORT_LUN,
+  [SCSI_WRITE_SAME10]           = CMD_WRITE_SAME10,
+  [SCSI_UNMAP]                  = CMD_UNMAP,
+  [SCSI_WRITE_SAME16]           = CMD_WRITE_SAME16,
+  [SCSI_SERVICE_ACTION_IN16]    = CMD_SERVICE_ACTION_IN16,
+#ifdef MSC_CDROM
+  [SCSI_READ_TOC]               = CMD_READ_TOC,
+  [SCSI_GET_CONFIGURATION]      = CMD_GET_CONFIGURATION,
+  [SCSI_GET_EVENT_STATUS]       = CMD_GET_EVENT_STATUS,
+  [SCSI_MODE_SENSE10]           = CMD_MODE_SENSE10,
+#endif
+};
+
+int
+msc_register_command (uint8_t opcode, uint8_t dir,
+		      msc_command_handler_t handler)
+{
+  int i;
+
+  if (scsi_command_index[opcode] != CMD_UNKNOWN)
+    return -1;
+
+  for (i = 0; i < MSC_USER_COMMANDS; i++)
+    if (msc_user_commands[i].handler == NULL
+	|| msc_user_commands[i].opcode == opcode)
       {
-	msc_state = MSC_ERROR;
-	usb_lld_stall_tx (ENDP6);
-	goto done;
+	msc_user_commands[i].opcode = opcode;
+	msc_user_commands[i].dir = dir;
+	msc_user_commands[i].handler = handler;
+	return 0;
       }
-  }
 
-  lba = (CBW.CBWCB[2] << 24) | (CBW.CBWCB[3] << 16)
-      | (CBW.CBWCB[4] <<  8) | CBW.CBWCB[5];
+  return -1;
+}
+
+
+/* called with holding the lock.  */
+static void
+msc_dispatch (const struct scsi_command *cmd)
+{
+#if MSC_MOUNT_PROFILE
+  mount_commands++;
+#endif
 
-  /* Transfer direction.*/
-  if (CBW.bmCBWFlags & 0x80)
+  if (CBW.CBWCB[0] == SCSI_REQUEST_SENSE)
     {
-      /* IN, Device to Host.*/
-      msc_state = MSC_DATA_IN;
-      if (CBW.CBWCB[0] == SCSI_READ10)
-	{
-	  const uint8_t *p;
+      (*cmd->handler) ();
+      return;
+    }
+
+  /* INQUIRY and REPORT LUNS keep the sense data for the host.  */
+  if (CBW.CBWCB[0] == SCSI_INQUIRY || CBW.CBWCB[0] == SCSI_REPORT_LUN)
+    {
+      (*cmd->handler) ();
+      return;
+    }
+
+  /*
+   * Queued unit attention or deferred error is reported by the next
+   * command, other than INQUIRY, REPORT LUNS and REQUEST SENSE.  The
+   * command is not executed, and its data is not transferred: all of
+   * it is the residue, and the bulk pipe of the data is stalled.
+   */
+  if (sense_queue_len)
+    {
+      sense_queue_get ();
+#ifdef FRAUCHEKY_UAS
+      if (!msc_uas)
+#endif
+	if (CBW.dCBWDataTransferLength != 0)
+	  {
+	    if ((CBW.bmCBWFlags & 0x80))
+	      usb_lld_stall_tx (FRAUCHEKY_ENDP);
+	    else
+	      usb_lld_stall_rx (FRAUCHEKY_ENDP);
+	  }
+      msc_send_status (MSC_CSW_STATUS_FAILED, CBW.dCBWDataTransferLength);
+      return;
+    }
+
+  msc_set_sense (0x00, 0x00, 0x00, 0, 0);
+  (*cmd->handler) ();
+}
+
+
+#ifdef FRAUCHEKY_UAS
+#define UAS_TMF_ABORT_TASK         0x01
+#define UAS_TMF_ABORT_TASK_SET     0x02
+#define UAS_TMF_CLEAR_TASK_SET     0x04
+#define UAS_TMF_LOGICAL_UNIT_RESET 0x08
+#define UAS_TMF_I_T_NEXUS_RESET    0x10
+#define UAS_TMF_QUERY_TASK         0x80
+
+#define UAS_RC_TMF_COMPLETE        0x00
+#define UAS_RC_INVALID_IU          0x02
+#define UAS_RC_TMF_NOT_SUPPORTED   0x04
+#define UAS_RC_TMF_SUCCEEDED       0x08
+#define UAS_RC_INCORRECT_LUN       0x09
 
-	  CSW.dCSWDataResidue = 0;
-	  while (1)
+/* called with holding the lock.  */
+static void
+uas_send_status (void)
+{
+  static uint8_t status[16 + SENSE_FIXED_LENGTH];
+  size_t len = 0;
+
+  memset (status, 0, 16);
+  status[0] = UAS_IU_SENSE;
+  status[2] = CSW.dCSWTag >> 8;
+  status[3] = CSW.dCSWTag;
+  if (CSW.bCSWStatus != MSC_CSW_STATUS_PASSED)
+    {
+      status[6] = 0x02;		/* CHECK CONDITION */
+      len = msc_build_sense (status + 16, 0);
+      /* Sense data is delivered with the status, no REQUEST SENSE.  */
+      msc_set_sense (0x00, 0x00, 0x00, 0, 0);
+    }
+  status[14] = len >> 8;
+  status[15] = len;
+  uas_send_iu (status, 16 + len);
+}
+
+/* called with holding the lock.  */
+static void
+uas_send_response (uint16_t tag, uint8_t code)
+{
+  static uint8_t response[8];
+
+  memset (response, 0, sizeof response);
+  response[0] = UAS_IU_RESPONSE;
+  response[2] = tag >> 8;
+  response[3] = tag;
+  response[7] = code;
+  uas_send_iu (response, sizeof response);
+}
+
+/* called with holding the lock.  */
+static void
+uas_remove (int i)
+{
+  memmove (uas_iu[i], uas_iu[i + 1], (uas_count - i - 1) * UAS_IU_SIZE);
+  uas_count--;
+}
+
+static int
+uas_lun_is_zero (const uint8_t *iu)
+{
+  int i;
+
+  for (i = 8; i < 16; i++)
+    if (iu[i])
+      return 0;
+  return 1;
+}
+
+/*
+ * Task management.  Commands in the queue can be aborted; the command
+ * in execution is already finished when this is handled.
+ */
+static void
+uas_task_management (const uint8_t *iu)
+{
+  uint16_t tag = (iu[2] << 8) | iu[3];
+  uint16_t task_tag = (iu[6] << 8) | iu[7];
+  uint8_t code = UAS_RC_TMF_COMPLETE;
+  int i;
+
+  if (!uas_lun_is_zero (iu))
+    code = UAS_RC_INCORRECT_LUN;
+  else
+    switch (iu[4])
+      {
+      case UAS_TMF_ABORT_TASK:
+      case UAS_TMF_QUERY_TASK:
+	for (i = 0; i < uas_count; i++)
+	  if (uas_iu[i][0] == UAS_IU_COMMAND
+	      && ((uas_iu[i][2] << 8) | uas_iu[i][3]) == task_tag)
 	    {
-	      if (CBW.CBWCB[7] == 0 && CBW.CBWCB[8] == 0)
-		{
-		  CSW.bCSWStatus = MSC_CSW_STATUS_PASSED;
-		  break;
-		}
-
-	      if (!MEDIA_AVAILABLE ())
-		r = SCSI_ERROR_NOT_READY;
+	      if (iu[4] == UAS_TMF_ABORT_TASK)
+		uas_remove (i);
 	      else
-		r = msc_scsi_read (lba, &p);
-
-	      if (r == 0)
-		{
-		  msc_send_data (p, 512);
-		  if (++CBW.CBWCB[5] == 0)
-		    if (++CBW.CBWCB[4] == 0)
-		      if (++CBW.CBWCB[3] == 0)
-			++CBW.CBWCB[2];
-		  if (CBW.CBWCB[8]-- == 0)
-		    CBW.CBWCB[7]--;
-		  CSW.dCSWDataResidue += 512;
-		  lba++;
-		}
-	      else
-		{
-		  CSW.bCSWStatus = MSC_CSW_STATUS_FAILED;
-		  contingent_allegiance = 1;
-		  if (r == SCSI_ERROR_NOT_READY)
-		    set_scsi_sense_data (SCSI_ERROR_NOT_READY, 0x3a);
-		  else
-		    set_scsi_sense_data (r, 0x00);
-		  break;
-		}
+		code = UAS_RC_TMF_SUCCEEDED;
+	      break;
 	    }
+	break;
+      case UAS_TMF_ABORT_TASK_SET:
+      case UAS_TMF_CLEAR_TASK_SET:
+      case UAS_TMF_LOGICAL_UNIT_RESET:
+      case UAS_TMF_I_T_NEXUS_RESET:
+	for (i = uas_count - 1; i >= 0; i--)
+	  if (uas_iu[i][0] == UAS_IU_COMMAND)
+	    uas_remove (i);
+	if (iu[4] == UAS_TMF_LOGICAL_UNIT_RESET
+	    || iu[4] == UAS_TMF_I_T_NEXUS_RESET)
+	  /* POWER ON, RESET, OR BUS DEVICE RESET OCCURRED */
+	  sense_queue_put (0x06, 0x29, 0x00, 0, 0);
+	break;
+      default:
+	code = UAS_RC_TMF_NOT_SUPPORTED;
+	break;
+      }
+
+  uas_send_response (tag, code);
+}
 
-	  msc_send_result (NULL, 0);
+/*
+ * UAS has no transfer length by the host.  Direction and length of
+ * data are given by the CDB: allocation length, parameter list
+ * length, or transfer length.
+ */
+static uint32_t
+uas_data_length (const struct scsi_command *cmd, uint8_t *dir_p)
+{
+  const uint8_t *cdb = CBW.CBWCB;
+  uint8_t dir = cmd->dir;
+  int i;
+
+  if (cmd->handler == scsi_unknown)
+    for (i = 0; i < MSC_USER_COMMANDS; i++)
+      if (msc_user_commands[i].handler != NULL
+	  && msc_user_commands[i].opcode == cdb[0])
+	{
+	  dir = msc_user_commands[i].dir;
+	  break;
 	}
+
+  if (cdb[0] == SCSI_VERIFY10 && (cdb[1] & SCSI_VERIFY10_BYTCHK))
+    dir = MSC_DIR_OUT;
+
+  *dir_p = dir;
+  if (dir == MSC_DIR_NONE)
+    return 0;
+
+  if (cmd->len == MSC_LEN_BLOCKS || cdb[0] == SCSI_VERIFY10)
+    return ((cdb[7] << 8) | cdb[8]) * MSC_SECTOR_SIZE;
+
+  switch (cdb[0])
+    {
+    case SCSI_INQUIRY:
+      return (cdb[3] << 8) | cdb[4];
+    case SCSI_READ_CAPACITY10:
+      return 8;
+    case SCSI_WRITE_SAME10:
+    case SCSI_WRITE_SAME16:
+      return MSC_SECTOR_SIZE;
+    default:
+      break;
+    }
+
+  switch (cdb[0] >> 5)		/* Group of the operation code.  */
+    {
+    case 0:
+      return cdb[4];
+    case 1:
+    case 2:
+      return (cdb[7] << 8) | cdb[8];
+    case 4:
+      return get_be32 (cdb + 10);
+    case 5:
+      return get_be32 (cdb + 6);
+    default:
+      return 0;
+    }
+}
+
+/* called with holding the lock.  */
+static void
+uas_handle_iu (void)
+{
+  const struct scsi_command *cmd;
+  uint8_t iu[UAS_IU_SIZE];
+  uint8_t dir;
+  uint16_t tag;
+  int i;
+
+  msc_state = MSC_IDLE;
+  if (!uas_rx_armed && uas_count < MSC_UAS_QUEUE)
+    uas_start_receive ();
+
+  if (uas_count == 0)
+    {
+      /* Wake up by an IU, or by reset (may switch to BOT).  */
+      msc_wait ();
+      return;
+    }
+
+  /* Task management first, so that it can abort queued commands.  */
+  for (i = 0; i < uas_count; i++)
+    if (uas_iu[i][0] == UAS_IU_TASK_MANAGEMENT)
+      break;
+  if (i == uas_count)
+    i = 0;
+
+  memcpy (iu, uas_iu[i], UAS_IU_SIZE);
+  uas_remove (i);
+  if (!uas_rx_armed)
+    uas_start_receive ();
+
+  tag = (iu[2] << 8) | iu[3];
+  if (iu[0] == UAS_IU_TASK_MANAGEMENT)
+    {
+      uas_task_management (iu);
+      return;
+    }
+  else if (iu[0] != UAS_IU_COMMAND)
+    {
+      uas_send_response (tag, UAS_RC_INVALID_IU);
+      return;
+    }
+
+  memset (&CBW, 0, sizeof CBW);
+  CBW.dCBWSignature = MSC_CBW_SIGNATURE;
+  CBW.dCBWTag = tag;
+  CBW.bCBWCBLength = 16;
+  memcpy (CBW.CBWCB, iu + 16, 16);
+  CSW.dCSWTag = tag;
+  medium = msc_medium;
+  cmd = &scsi_commands[scsi_command_index[CBW.CBWCB[0]]];
+  CBW.dCBWDataTransferLength = uas_data_length (cmd, &dir);
+  CBW.bmCBWFlags = (dir == MSC_DIR_IN) ? 0x80 : 0x00;
+  uas_ready = 0;
+
+  if (!uas_lun_is_zero (iu))
+    {
+      msc_check_condition (0x05, 0x25); /* LOGICAL UNIT NOT SUPPORTED */
+      msc_send_status (MSC_CSW_STATUS_FAILED, 0);
     }
   else
+    msc_dispatch (cmd);
+}
+#endif
+
+
+static void
+msc_handle_command (void)
+{
+  size_t n;
+  const struct scsi_command *cmd;
+  uint32_t len;
+
+  chopstx_mutex_lock (&msc_mutex);
+  if (msc_suspended)
     {
-      /* OUT, Host to Device.*/
-      if (CBW.CBWCB[0] == SCSI_WRITE10)
-	{
-	  CSW.dCSWDataResidue = CBW.dCBWDataTransferLength;
+      /* Low-power wait, until fraucheky_resume.  */
+      msc_state = MSC_IDLE;
+      while (msc_suspended)
+	msc_wait ();
+      goto done;
+    }
 
-	  while (1)
-	    {
-	      if (CBW.CBWCB[8] == 0 && CBW.CBWCB[7] == 0)
-		{
-		  CSW.bCSWStatus = MSC_CSW_STATUS_PASSED;
-		  break;
-		}
-
-	      msc_recv_data ();
-	      if (msg != RDY_OK)
-		/* ignore erroneous packet, ang go next.  */
-		continue;
-
-	      if (!MEDIA_AVAILABLE ())
-		r = SCSI_ERROR_NOT_READY;
-	      else
-		r = msc_scsi_write (lba, buf, 512);
-
-	      if (r == 0)
-		{
-		  if (++CBW.CBWCB[5] == 0)
-		    if (++CBW.CBWCB[4] == 0)
-		      if (++CBW.CBWCB[3] == 0)
-			++CBW.CBWCB[2];
-		  if (CBW.CBWCB[8]-- == 0)
-		    CBW.CBWCB[7]--;
-		  CSW.dCSWDataResidue -= 512;
-		  lba++;
-		}
-	      else
-		{
-		  CSW.bCSWStatus = MSC_CSW_STATUS_FAILED;
-		  contingent_allegiance = 1;
-		  if (r == SCSI_ERROR_NOT_READY)
-		    set_scsi_sense_data (SCSI_ERROR_NOT_READY, 0x3a);
-		  else
-		    set_scsi_sense_data (r, 0x00);
-		  break;
-		}
-	    }
+#if MSC_PIN_SECTORS
+  if (pin_stage_pending)
+    msc_pin_stage ();
+#endif
 
-	  msc_send_result (NULL, 0);
-	}
+#ifdef FRAUCHEKY_UAS
+  if (msc_uas)
+    {
+      uas_handle_iu ();
+      goto done;
+    }
+#endif
+
+  msc_state = MSC_IDLE;
+  if (!cbw_armed)
+    {
+      msg = RDY_RESET;
+      usb_start_receive ((uint8_t *)&CBW, sizeof CBW);
+      cbw_armed = 1;
+    }
+
+  /* CBW may have been received, while the thread was woken.  */
+  if (msg != RDY_OK)
+    msc_wait ();
+
+#ifdef FRAUCHEKY_UAS
+  if (msc_uas)
+    /* Switched to UAS while waiting.  */
+    goto done;
+#endif
+
+  if (msg == RDY_RESUME)
+    /* Woken by msc_rearm, or resumed: wait for it again.  */
+    goto done;
+
+  cbw_armed = 0;
+
+  if (msg != RDY_OK)
+    {
+      /* Error occured, ignore the request and go into error state */
+      msc_state = MSC_ERROR;
+      usb_lld_stall_rx (FRAUCHEKY_ENDP);
+      MSC_COMMAND_DONE (-1);
+      goto done; 
+    }
+
+  n = ep6_out.rxcnt;
+
+  if ((n != sizeof (struct CBW)) || (CBW.dCBWSignature != MSC_CBW_SIGNATURE))
+    {
+      msc_state = MSC_ERROR;
+      usb_lld_stall_rx (FRAUCHEKY_ENDP);
+      MSC_COMMAND_DONE (-1);
+      goto done;
     }
 
+  CSW.dCSWTag = CBW.dCBWTag;
+  medium = msc_medium;
+  cmd = &scsi_commands[scsi_command_index[CBW.CBWCB[0]]];
+
+  /* Check direction and length of data against the command.  */
+  if (cmd->len == MSC_LEN_BLOCKS)
+    len = ((CBW.CBWCB[7] << 8) | CBW.CBWCB[8]) * MSC_SECTOR_SIZE;
+  else
+    len = cmd->len;
+
+  if ((len != 0 && CBW.dCBWDataTransferLength != 0
+       && ((cmd->dir == MSC_DIR_IN && !(CBW.bmCBWFlags & 0x80))
+	   || (cmd->dir == MSC_DIR_OUT && (CBW.bmCBWFlags & 0x80))))
+      || (cmd->len == MSC_LEN_BLOCKS && CBW.dCBWDataTransferLength < len))
+    msc_phase_error ();
+  else
+    msc_dispatch (cmd);
+
+  MSC_COMMAND_DONE (msc_state == MSC_ERROR ? -1 : CSW.bCSWStatus);
+
  done:
   chopstx_mutex_unlock (&msc_mutex);
 }
@@ -600,19 +2611,99 @@ fraucheky_enabled (void)
 
 void
 fraucheky_reset (void)
+{
+  if (!fraucheky_main_active)
+    return;
+
+  chopstx_mutex_lock (&msc_mutex);
+  cbw_armed = 0;
+  if (resume_pending && msc_state == MSC_IDLE)
+    /* Configured again after resume, keep the state.  */
+    msg = RDY_RESUME;
+  chopstx_cond_signal (&msc_cond);
+  chopstx_mutex_unlock (&msc_mutex);
+}
+
+/*
+ * Suspend and resume, called by the application for the events of
+ * the bus.  The MSC thread is woken, when it's waiting for a command,
+ * to go into (or out of) the low-power wait.  On resume, receiving a
+ * command is kept armed, unless the endpoint has been configured
+ * again (by fraucheky_reset) while suspended.
+ */
+void
+fraucheky_suspend (void)
+{
+  if (!fraucheky_main_active)
+    return;
+
+  chopstx_mutex_lock (&msc_mutex);
+  msc_suspended = 1;
+  msc_rearm ();
+  chopstx_mutex_unlock (&msc_mutex);
+}
+
+void
+fraucheky_resume (void)
+{
+  if (!fraucheky_main_active)
+    return;
+
+  chopstx_mutex_lock (&msc_mutex);
+  if (msc_suspended)
+    {
+      msc_suspended = 0;
+      resume_pending = 1;
+      if (p_msc_clock)
+	resume_start = (*p_msc_clock) ();
+#ifdef FRAUCHEKY_UAS
+      uas_rx_armed = 0;
+#endif
+      if (msc_state == MSC_IDLE)
+	{
+	  msg = RDY_RESUME;
+	  chopstx_cond_signal (&msc_cond);
+	}
+    }
+  chopstx_mutex_unlock (&msc_mutex);
+}
+
+#ifdef FRAUCHEKY_UAS
+/*
+ * Select UAS (ON != 0) or Bulk-Only Transport.  It's called by
+ * fraucheky_set_alt, after the endpoints are configured.
+ */
+void
+msc_uas_set (int on)
 {
   if (fraucheky_main_active)
-    chopstx_cond_signal (&msc_cond);
+    chopstx_mutex_lock (&msc_mutex);
+  msc_uas = on;
+  uas_count = 0;
+  uas_rx_armed = 0;
+  if (fraucheky_main_active)
+    chopstx_mutex_unlock (&msc_mutex);
+  fraucheky_reset ();
 }
+#endif
 
 void
 fraucheky_main (void)
 {
   chopstx_mutex_init (&msc_mutex);
   chopstx_cond_init (&msc_cond);
+  chopstx_cond_init (&msc_request_cond);
 
   fraucheky_main_active = 1;
-  msc_media_insert_change (128);
+  if (p_msc_clock)
+    run_start = (*p_msc_clock) ();
+  msc_medium_rom.nblocks = msc_scsi_capacity ();
+  if (p_msc_scsi_discard)
+    {
+      msc_medium_rom.discard = msc_scsi_discard;
+      msc_medium_rom.discard_zero = msc_scsi_discard_zero;
+    }
+  msc_media_swap (&msc_medium_rom);
   while (fraucheky_main_active)
     msc_handle_command ();
 }
@@ -626,9 +2717,13 @@ msc_main (void *arg)
 
   chopstx_mutex_init (&msc_mutex);
   chopstx_cond_init (&msc_cond);
+  chopstx_cond_init (&msc_request_cond);
+
+  if (p_msc_clock)
+    run_start = (*p_msc_clock) ();
 
   /* Initially, it starts with no media */
-  msc_media_insert_change (0);
+  msc_media_swap (NULL);
   while (1)
     msc_handle_command ();
 
@@ -1,2 +1,123 @@
 void msc_init (void);
-void msc_media_insert_change (uint32_t nblocks); /* 0 means no-media.  */
+
+/*
+ * The MSC function can be a part of composite device.  Interface
+ * number, endpoint, and its packet memory (64-byte for IN, 64-byte
+ * for OUT) can be configured by config.h.  EP6_IN_Callback and
+ * EP6_OUT_Callback are for FRAUCHEKY_ENDP.
+ */
+#ifndef FRAUCHEKY_INTERFACE
+#define FRAUCHEKY_INTERFACE   0
+#endif
+#ifndef FRAUCHEKY_ENDP
+#define FRAUCHEKY_ENDP        ENDP6
+#endif
+#ifndef FRAUCHEKY_ENDP_TXADDR
+#define FRAUCHEKY_ENDP_TXADDR 0x180
+#endif
+#ifndef FRAUCHEKY_ENDP_RXADDR
+#define FRAUCHEKY_ENDP_RXADDR 0x1c0
+#endif
+
+/*
+ * With FRAUCHEKY_UAS, the interface has alternate setting 1 for USB
+ * Attached SCSI, with the command pipe and status pipe of
+ * FRAUCHEKY_UAS_ENDP (EP7_OUT_Callback and EP7_IN_Callback), in
+ * addition to the data pipes of FRAUCHEKY_ENDP.  Bulk-Only Transport
+ * (alternate setting 0) remains the default.  The application calls
+ * fraucheky_set_alt for SET_INTERFACE, and replies the value of
+ * fraucheky_get_alt for GET_INTERFACE.
+ */
+#ifndef FRAUCHEKY_UAS_ENDP
+#define FRAUCHEKY_UAS_ENDP        ENDP7
+#endif
+#ifndef FRAUCHEKY_UAS_ENDP_TXADDR
+#define FRAUCHEKY_UAS_ENDP_TXADDR 0x100
+#endif
+#ifndef FRAUCHEKY_UAS_ENDP_RXADDR
+#define FRAUCHEKY_UAS_ENDP_RXADDR 0x140
+#endif
+
+struct usb_dev;
+int fraucheky_set_alt (struct usb_dev *dev, uint16_t alt);
+uint8_t fraucheky_get_alt (void);
+
+/*
+ * For suspend of the bus, the application calls fraucheky_suspend,
+ * and fraucheky_resume on resume (or on reset, when the host resets
+ * the device to resume it).  The state of MSC is kept while
+ * suspended.
+ */
+void fraucheky_suspend (void);
+void fraucheky_resume (void);
+
+/* Interface and endpoint descriptors, for a configuration descriptor.  */
+#define FRAUCHEKY_BOT_DESC_LENGTH (9+7+7)
+#define FRAUCHEKY_BOT_DESC						\
+  /* Interface Descriptor.*/						\
+  9,			         /* bLength: Interface Descriptor size */ \
+  INTERFACE_DESCRIPTOR,          /* bDescriptorType: Interface         */ \
+  FRAUCHEKY_INTERFACE,		 /* bInterfaceNumber.                  */ \
+  0x00,				 /* bAlternateSetting.                 */ \
+  0x02,				 /* bNumEndpoints.                     */ \
+  0x08,				 /* bInterfaceClass (Mass Stprage).    */ \
+  0x06,				 /* bInterfaceSubClass (SCSI		\
+				    transparent command set, MSCO	\
+				    chapter 2).                        */ \
+  0x50,				 /* bInterfaceProtocol (Bulk-Only	\
+				    Mass Storage, MSCO chapter 3).     */ \
+  0x00,				 /* iInterface.                        */ \
+  /* Endpoint Descriptor.*/						\
+  7,			         /* bLength: Endpoint Descriptor size  */ \
+  ENDPOINT_DESCRIPTOR,   	 /* bDescriptorType: Endpoint          */ \
+  0x80|FRAUCHEKY_ENDP,		 /* bEndpointAddress: (IN)             */ \
+  0x02,				 /* bmAttributes (Bulk).               */ \
+  0x40, 0x00,			 /* wMaxPacketSize.                    */ \
+  0x00,				 /* bInterval (ignored for bulk).      */ \
+  /* Endpoint Descriptor.*/						\
+  7,			         /* bLength: Endpoint Descriptor size  */ \
+  ENDPOINT_DESCRIPTOR,   	 /* bDescriptorType: Endpoint          */ \
+  FRAUCHEKY_ENDP,		 /* bEndpointAddress: (OUT)            */ \
+  0x02,				 /* bmAttributes (Bulk).               */ \
+  0x40, 0x00,			 /* wMaxPacketSize.                    */ \
+  0x00				 /* bInterval (ignored for bulk).      */
+
+/* Endpoint Descriptor followed by Pipe Usage Descriptor.  */
+#define FRAUCHEKY_UAS_PIPE(addr, id)					\
+  7,			         /* bLength: Endpoint Descriptor size  */ \
+  ENDPOINT_DESCRIPTOR,   	 /* bDescriptorType: Endpoint          */ \
+  addr,				 /* bEndpointAddress.                  */ \
+  0x02,				 /* bmAttributes (Bulk).               */ \
+  0x40, 0x00,			 /* wMaxPacketSize.                    */ \
+  0x00,				 /* bInterval (ignored for bulk).      */ \
+  4,				 /* bLength: Pipe Usage size.          */ \
+  0x24,				 /* bDescriptorType: Pipe Usage.       */ \
+  id,				 /* bPipeID.                           */ \
+  0x00				 /* Reserved.                          */
+
+#define FRAUCHEKY_UAS_DESC_LENGTH (9+(7+4)*4)
+#define FRAUCHEKY_UAS_DESC						\
+  /* Interface Descriptor.*/						\
+  9,			         /* bLength: Interface Descriptor size */ \
+  INTERFACE_DESCRIPTOR,          /* bDescriptorType: Interface         */ \
+  FRAUCHEKY_INTERFACE,		 /* bInterfaceNumber.                  */ \
+  0x01,				 /* bAlternateSetting.                 */ \
+  0x04,				 /* bNumEndpoints.                     */ \
+  0x08,				 /* bInterfaceClass (Mass Stprage).    */ \
+  0x06,				 /* bInterfaceSubClass (SCSI		\
+				    transparent command set).          */ \
+  0x62,				 /* bInterfaceProtocol (UAS).          */ \
+  0x00,				 /* iInterface.                        */ \
+  FRAUCHEKY_UAS_PIPE (FRAUCHEKY_UAS_ENDP, 0x01),	/* Command.  */	\
+  FRAUCHEKY_UAS_PIPE (0x80|FRAUCHEKY_UAS_ENDP, 0x02),	/* Status.  */	\
+  FRAUCHEKY_UAS_PIPE (0x80|FRAUCHEKY_ENDP, 0x03),	/* Data-in.  */	\
+  FRAUCHEKY_UAS_PIPE (FRAUCHEKY_ENDP, 0x04)		/* Data-out.  */
+
+#ifdef FRAUCHEKY_UAS
+#define FRAUCHEKY_MSC_DESC_LENGTH \
+  (FRAUCHEKY_BOT_DESC_LENGTH + FRAUCHEKY_UAS_DESC_LENGTH)
+#define FRAUCHEKY_MSC_DESC FRAUCHEKY_BOT_DESC, FRAUCHEKY_UAS_DESC
+#else
+#define FRAUCHEKY_MSC_DESC_LENGTH FRAUCHEKY_BOT_DESC_LENGTH
+#define FRAUCHEKY_MSC_DESC FRAUCHEKY_BOT_DESC
+#endif